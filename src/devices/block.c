@@ -1,9 +1,21 @@
 #include "devices/block.h"
+#include <inttypes.h>
 #include <list.h>
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Ticks a request may wait while the elevator serves requests
+   further along the disk before it is served out of turn. */
+#define BLOCK_DEADLINE (TIMER_FREQ / 4)
+
+/* Most sectors merged into a single batch, so that one long
+   run of requests does not hold up the rest of the queue. */
+#define BLOCK_MAX_BATCH 128
 
 /* A block device. */
 struct block
@@ -19,6 +31,14 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+
+    /* Request queue, for devices whose driver has a START
+       operation.  Accessed only with interrupts off. */
+    struct list queue;                  /* Waiting bios, by sector. */
+    struct list fifo;                   /* Waiting bios, oldest first. */
+    struct block_batch batch;           /* Batch being transferred. */
+    bool busy;                          /* Is BATCH being transferred? */
+    block_sector_t head;                /* Sector following last batch. */
   };
 
 /* List of all block devices. */
@@ -27,6 +47,11 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 /* The block block assigned to each Pintos role. */
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
+/* I/O latency statistics, over all devices. */
+static unsigned long long bio_cnt;      /* Completed bios. */
+static uint64_t bio_total_ns;           /* Their total latency. */
+static uint64_t bio_max_ns;             /* Their greatest latency. */
+
 static struct block *list_elem_to_block (struct list_elem *);
 
 /* Returns a human-readable name for the given block device
@@ -113,6 +138,277 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Verifies that the CNT sectors starting at SECTOR all lie
+   within BLOCK.  Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  check_sector (block, sector);
+  if (cnt > block->size - sector)
+    check_sector (block, block->size);
+}
+
+/* Returns true if bio A is for an earlier sector than bio B. */
+static bool
+bio_less (const struct list_elem *a, const struct list_elem *b,
+          void *aux UNUSED)
+{
+  return (list_entry (a, struct bio, elem)->sector
+          < list_entry (b, struct bio, elem)->sector);
+}
+
+/* Returns true if bio B can be transferred in the same batch as,
+   and right after, bio A. */
+static bool
+bios_adjacent (const struct bio *a, const struct bio *b)
+{
+  return a->write == b->write && a->sector + a->cnt == b->sector;
+}
+
+/* Reports that BIO has completed, by calling its END function or,
+   if it has none, by waking up its waiter.  Interrupts must be
+   off. */
+static void
+bio_complete (struct bio *bio)
+{
+  uint64_t latency = timer_ns () - bio->submit_ns;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  bio_cnt++;
+  bio_total_ns += latency;
+  if (latency > bio_max_ns)
+    bio_max_ns = latency;
+
+  if (bio->end != NULL)
+    bio->end (bio);
+  else
+    sema_up (&bio->done);
+}
+
+/* Starts transferring BLOCK's next batch of bios, if any.  Must
+   be called with interrupts off, while BLOCK is not busy.
+
+   Bios are served in C-LOOK order: in increasing order of sector
+   from the end of the last batch, then back around to the lowest
+   sector.  A bio that has waited past its deadline goes first
+   instead.  Bios for adjacent sectors in the same direction are
+   merged into a single batch. */
+static void
+dispatch (struct block *block)
+{
+  struct block_batch *b = &block->batch;
+  struct bio *first;
+  struct list_elem *e;
+  size_t cnt;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (!block->busy);
+
+  if (list_empty (&block->queue))
+    return;
+
+  /* Choose the first bio to serve. */
+  first = list_entry (list_front (&block->fifo), struct bio, fifo_elem);
+  if (timer_ticks () < first->deadline)
+    {
+      for (e = list_begin (&block->queue); e != list_end (&block->queue);
+           e = list_next (e))
+        if (list_entry (e, struct bio, elem)->sector >= block->head)
+          break;
+      if (e == list_end (&block->queue))
+        e = list_begin (&block->queue);
+      first = list_entry (e, struct bio, elem);
+    }
+
+  /* Extend the batch backward over adjacent bios... */
+  cnt = first->cnt;
+  while (list_prev (&first->elem) != list_head (&block->queue))
+    {
+      struct bio *prev = list_entry (list_prev (&first->elem),
+                                     struct bio, elem);
+      if (!bios_adjacent (prev, first) || cnt + prev->cnt > BLOCK_MAX_BATCH)
+        break;
+      cnt += prev->cnt;
+      first = prev;
+    }
+
+  /* ...then move bios into it going forward. */
+  b->sector = first->sector;
+  b->cnt = 0;
+  b->write = first->write;
+  list_init (&b->bios);
+  e = &first->elem;
+  for (;;)
+    {
+      struct bio *bio = list_entry (e, struct bio, elem);
+      struct bio *next;
+
+      e = list_remove (e);
+      list_remove (&bio->fifo_elem);
+      list_push_back (&b->bios, &bio->elem);
+      b->cnt += bio->cnt;
+
+      if (e == list_end (&block->queue))
+        break;
+      next = list_entry (e, struct bio, elem);
+      if (!bios_adjacent (bio, next) || b->cnt + next->cnt > BLOCK_MAX_BATCH)
+        break;
+    }
+
+  block->busy = true;
+  block->head = b->sector + b->cnt;
+  block->ops->start (block->aux, b);
+}
+
+/* Submits BIO to BLOCK and returns, usually before the transfer
+   is done.  BIO and the buffers it names must stay untouched
+   until it completes.  When it does, BIO's END function is
+   called, with interrupts off and typically from an interrupt
+   handler, so END must not sleep.  If END is null, the
+   submitter must instead call bio_wait() to wait for completion.
+
+   BIO's SECTOR member is undefined after submission, because
+   partitions rewrite it to address the underlying disk. */
+void
+block_submit (struct block *block, struct bio *bio)
+{
+  enum intr_level old_level;
+  size_t i;
+
+  ASSERT (bio->vec_cnt > 0);
+
+  bio->submit_ns = timer_ns ();
+  bio->cnt = 0;
+  for (i = 0; i < bio->vec_cnt; i++)
+    bio->cnt += bio->vec[i].cnt;
+  check_sectors (block, bio->sector, bio->cnt);
+  if (bio->write)
+    {
+      ASSERT (block->type != BLOCK_FOREIGN);
+      block->write_cnt += bio->cnt;
+    }
+  else
+    block->read_cnt += bio->cnt;
+  if (bio->end == NULL)
+    sema_init (&bio->done, 0);
+
+  if (block->ops->submit != NULL)
+    block->ops->submit (block->aux, bio);
+  else if (block->ops->start != NULL)
+    {
+      bio->deadline = timer_ticks () + BLOCK_DEADLINE;
+      old_level = intr_disable ();
+      list_insert_ordered (&block->queue, &bio->elem, bio_less, NULL);
+      list_push_back (&block->fifo, &bio->fifo_elem);
+      if (!block->busy)
+        dispatch (block);
+      intr_set_level (old_level);
+    }
+  else
+    {
+      /* The driver transfers synchronously, either a bio_vec at
+         a time or one sector at a time. */
+      const struct block_operations *ops = block->ops;
+      block_sector_t sector = bio->sector;
+
+      ASSERT (!intr_context ());
+      for (i = 0; i < bio->vec_cnt; i++)
+        {
+          uint8_t *buffer = bio->vec[i].buffer;
+          size_t cnt = bio->vec[i].cnt;
+          size_t j;
+
+          if (bio->write && ops->write_multiple != NULL)
+            ops->write_multiple (block->aux, sector, cnt, buffer);
+          else if (!bio->write && ops->read_multiple != NULL)
+            ops->read_multiple (block->aux, sector, cnt, buffer);
+          else
+            for (j = 0; j < cnt; j++)
+              {
+                if (bio->write)
+                  ops->write (block->aux, sector + j, buffer);
+                else
+                  ops->read (block->aux, sector + j, buffer);
+                buffer += BLOCK_SECTOR_SIZE;
+              }
+          sector += cnt;
+        }
+      old_level = intr_disable ();
+      bio_complete (bio);
+      intr_set_level (old_level);
+    }
+}
+
+/* Waits for BIO, which was submitted with a null END function,
+   to complete. */
+void
+bio_wait (struct bio *bio)
+{
+  ASSERT (bio->end == NULL);
+  sema_down (&bio->done);
+}
+
+/* Transfers the CNT sectors starting at SECTOR between BLOCK and
+   BUFFER, and waits for the transfer to complete. */
+static void
+transfer (struct block *block, block_sector_t sector, size_t cnt,
+          void *buffer, bool write)
+{
+  struct bio_vec vec;
+  struct bio bio;
+
+  vec.buffer = buffer;
+  vec.cnt = cnt;
+  bio.sector = sector;
+  bio.write = write;
+  bio.vec = &vec;
+  bio.vec_cnt = 1;
+  bio.end = NULL;
+  block_submit (block, &bio);
+  bio_wait (&bio);
+}
+
+/* Returns the buffer for the sector numbered IDX, counting from
+   0, within batch B. */
+void *
+block_batch_buffer (struct block_batch *b, size_t idx)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&b->bios); e != list_end (&b->bios);
+       e = list_next (e))
+    {
+      struct bio *bio = list_entry (e, struct bio, elem);
+      size_t i;
+
+      for (i = 0; i < bio->vec_cnt; i++)
+        {
+          if (idx < bio->vec[i].cnt)
+            return (uint8_t *) bio->vec[i].buffer + idx * BLOCK_SECTOR_SIZE;
+          idx -= bio->vec[i].cnt;
+        }
+    }
+  NOT_REACHED ();
+}
+
+/* Called by a driver, with interrupts off, when it has finished
+   transferring batch B.  Completes each of B's bios and starts
+   the device's next batch.  B must not be used afterward. */
+void
+block_batch_done (struct block_batch *b)
+{
+  struct block *block = b->block;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (block->busy && b == &block->batch);
+
+  while (!list_empty (&b->bios))
+    bio_complete (list_entry (list_pop_front (&b->bios), struct bio, elem));
+  block->busy = false;
+  dispatch (block);
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -120,9 +416,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  transfer (block, sector, 1, buffer, false);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +427,35 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  transfer (block, sector, 1, (void *) buffer, true);
+}
+
+/* Reads the CNT consecutive sectors starting at SECTOR from
+   BLOCK into BUFFER, which must have room for CNT *
+   BLOCK_SECTOR_SIZE bytes.  If BLOCK's driver supports it, this
+   takes a single request to the device, instead of one per
+   sector.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffer)
+{
+  transfer (block, sector, cnt, buffer, false);
+}
+
+/* Writes the CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   If BLOCK's driver supports it, this takes a single request to
+   the device, instead of one per sector.  Returns after the
+   block device has acknowledged receiving the data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                      const void *buffer)
+{
+  transfer (block, sector, cnt, (void *) buffer, true);
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -176,6 +495,10 @@ block_print_stats (void)
                   block->read_cnt, block->write_cnt);
         }
     }
+  if (bio_cnt > 0)
+    printf ("Block I/O: %llu requests, %"PRIu64" us average latency, "
+            "%"PRIu64" us maximum\n",
+            bio_cnt, bio_total_ns / bio_cnt / 1000, bio_max_ns / 1000);
 }
 
 /* Registers a new block device with the given NAME.  If
@@ -200,6 +523,11 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  list_init (&block->queue);
+  list_init (&block->fifo);
+  block->batch.block = block;
+  block->busy = false;
+  block->head = 0;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
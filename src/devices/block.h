@@ -2,7 +2,10 @@
 #define DEVICES_BLOCK_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <inttypes.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,18 +56,101 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt,
+                          void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous I/O. */
+
+struct bio;
+typedef void bio_end_func (struct bio *);
+
+/* Part of a bio's buffer. */
+struct bio_vec
+  {
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    size_t cnt;                         /* Number of sectors. */
+  };
+
+/* A block I/O request: a transfer of consecutive sectors to or
+   from a vector of buffers, which together hold the sectors in
+   order.  See block_submit() for details. */
+struct bio
+  {
+    /* Set by the submitter. */
+    block_sector_t sector;              /* First sector. */
+    bool write;                         /* True to write, false to read. */
+    struct bio_vec *vec;                /* Buffers. */
+    size_t vec_cnt;                     /* Number of elements in VEC. */
+    bio_end_func *end;                  /* Called on completion, or null. */
+    void *aux;                          /* For use by END. */
+
+    /* Owned by the block layer. */
+    size_t cnt;                         /* Total number of sectors. */
+    struct list_elem elem;              /* Element in queue or batch. */
+    struct list_elem fifo_elem;         /* Element in fifo. */
+    int64_t deadline;                   /* Tick by which to serve it. */
+    uint64_t submit_ns;                 /* Time of submission. */
+    struct semaphore done;              /* Up'd on completion if no END. */
+  };
+
+void block_submit (struct block *, struct bio *);
+void bio_wait (struct bio *);
+
 /* Statistics. */
 void block_print_stats (void);
 
 /* Lower-level interface to block device drivers. */
 
+/* A run of consecutive sectors to transfer in one direction,
+   gathered from one or more queued bios.  The block layer hands
+   a device's driver one batch at a time. */
+struct block_batch
+  {
+    struct block *block;                /* Device. */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    bool write;                         /* True to write, false to read. */
+    struct list bios;                   /* Bios, in sector order. */
+  };
+
+void *block_batch_buffer (struct block_batch *, size_t idx);
+void block_batch_done (struct block_batch *);
+
+/* Driver operations.
+
+   A driver for real hardware provides START.  The block layer
+   then queues bios for the device, sorts and merges them, and
+   calls START, with interrupts off, to begin transferring each
+   batch.  START must not sleep.  When the transfer is complete,
+   typically in the device's interrupt handler, the driver calls
+   block_batch_done(), which may call START again for the next
+   batch.
+
+   A driver layered on another block device, such as a
+   partition, provides SUBMIT, which receives each bio as passed
+   to block_submit() and is responsible for seeing it completed,
+   usually by adjusting its SECTOR and submitting it to the
+   underlying device.
+
+   A simple driver may instead provide READ and WRITE, which the
+   block layer calls synchronously, one sector at a time.  If it
+   can transfer several consecutive sectors at once, it may also
+   provide READ_MULTIPLE and WRITE_MULTIPLE, which the block layer
+   then calls once for each of a bio's bio_vecs instead. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+    void (*start) (void *aux, struct block_batch *);
+    void (*submit) (void *aux, struct bio *);
   };
 
 struct block *block_register (const char *name, enum block_type,
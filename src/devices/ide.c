@@ -34,6 +34,7 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +50,16 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+
+/* Most sectors we transfer with a single command.  The sector
+   count register is 8 bits wide. */
+#define MAX_TRANSFER_SECTORS 128
+
+/* Most sectors per interrupt we ask for in multiple mode. */
+#define MAX_MULTIPLE_SECTORS 16
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +68,13 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    size_t multiple_cnt;        /* Sectors per interrupt with READ/WRITE
+                                   MULTIPLE, or 0 to use READ/WRITE
+                                   SECTOR. */
+
+    struct block_batch *batch;  /* Batch in progress or waiting, if any. */
+    size_t done_cnt;            /* Sectors of BATCH transferred so far. */
+    size_t command_end;         /* DONE_CNT at end of current command. */
   };
 
 /* An ATA channel (aka controller).
@@ -67,10 +85,12 @@ struct channel
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
 
-    struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
-    struct semaphore completion_wait;   /* Up'd by interrupt handler. */
+    struct semaphore completion_wait;   /* Up'd by interrupt handler
+                                           when ACTIVE is null. */
+    struct ata_disk *active;    /* Disk with an asynchronous transfer in
+                                   progress, if any. */
 
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
@@ -84,11 +104,12 @@ static struct block_operations ide_operations;
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, size_t cnt);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sectors (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
-static void input_sector (struct channel *, void *);
-static void output_sector (struct channel *, const void *);
+static void input_sectors (struct channel *, void *, size_t cnt);
+static void output_sectors (struct channel *, const void *, size_t cnt);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -123,9 +144,9 @@ ide_init (void)
         default:
           NOT_REACHED ();
         }
-      lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->active = NULL;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +157,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple_cnt = 0;
+          d->batch = NULL;
         }
 
       /* Register interrupt handler. */
@@ -279,7 +302,7 @@ identify_ata_device (struct ata_disk *d)
       d->is_ata = false;
       return;
     }
-  input_sector (c, id);
+  input_sectors (c, id, 1);
 
   /* Calculate capacity.
      Read model name and serial number. */
@@ -303,12 +326,45 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Enable multiple mode, if the disk supports it, so that
+     multi-sector transfers interrupt once per several sectors
+     rather than once per sector.  Word 47 gives the most sectors
+     per interrupt the disk allows. */
+  set_multiple_mode (d, *(uint16_t *) &id[47 * 2] & 0xff);
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
   partition_scan (block);
 }
 
+/* Sends a SET MULTIPLE MODE command to disk D asking for the
+   largest power of 2 that is no more than CNT or
+   MAX_MULTIPLE_SECTORS sectors per interrupt.  Sets D's
+   multiple_cnt to the count if the disk accepts it, otherwise to
+   0. */
+static void
+set_multiple_mode (struct ata_disk *d, size_t cnt) 
+{
+  struct channel *c = d->channel;
+
+  d->multiple_cnt = 0;
+  if (cnt > MAX_MULTIPLE_SECTORS)
+    cnt = MAX_MULTIPLE_SECTORS;
+  while ((cnt & (cnt - 1)) != 0)
+    cnt &= cnt - 1;
+  if (cnt < 2)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+    d->multiple_cnt = cnt;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +393,162 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+/* Asynchronous I/O.
+
+   The block layer hands us one batch of consecutive sectors at
+   a time for each disk.  A batch is transferred with one command
+   per MAX_TRANSFER_SECTORS sectors.  The commands are driven
+   from the channel's interrupt handler, so no thread waits on
+   the channel while a transfer is in progress.  Only one disk
+   on a channel can have a command in progress at a time, so a
+   batch for the other disk waits until the channel is free. */
+
+static void start_command (struct ata_disk *);
+static void transfer_block (struct ata_disk *);
+static bool poll_while_busy (const struct ata_disk *);
+
+/* Starts transferring BATCH to or from disk D, or, if D's
+   channel is busy with the other disk, arranges for it to start
+   once the channel is free.  Called by the block layer with
+   interrupts off. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_start (void *d_, struct block_batch *batch)
 {
   struct ata_disk *d = d_;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (d->batch == NULL);
+
+  d->batch = batch;
+  d->done_cnt = 0;
+  if (d->channel->active == NULL)
+    start_command (d);
+}
+
+static struct block_operations ide_operations =
+  {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    ide_start,
+    NULL
+  };
+
+/* Issues the command for the next part of disk D's batch, of up
+   to MAX_TRANSFER_SECTORS sectors.  For a write, also sends the
+   first block of data. */
+static void
+start_command (struct ata_disk *d)
+{
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  struct block_batch *b = d->batch;
+  size_t cnt = b->cnt - d->done_cnt;
+  uint8_t command;
+
+  if (cnt > MAX_TRANSFER_SECTORS)
+    cnt = MAX_TRANSFER_SECTORS;
+
+  c->active = d;
+  d->command_end = d->done_cnt + cnt;
+  select_sectors (d, b->sector + d->done_cnt, cnt);
+  if (b->write)
+    command = d->multiple_cnt > 0 ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY;
+  else
+    command = d->multiple_cnt > 0 ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY;
+  c->expecting_interrupt = true;
+  outb (reg_command (c), command);
+
+  /* The disk asks for the first block of a write right away,
+     without an interrupt. */
+  if (b->write)
+    transfer_block (d);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+/* Waits for disk D to be ready for data and then transfers the
+   next block of its current command: the multiple mode count of
+   sectors, or one sector if multiple mode is off, or fewer at
+   the end of the command. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+transfer_block (struct ata_disk *d)
 {
-  struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  struct block_batch *b = d->batch;
+  size_t block_cnt = d->multiple_cnt > 0 ? d->multiple_cnt : 1;
+  size_t end = d->done_cnt + block_cnt;
+
+  if (end > d->command_end)
+    end = d->command_end;
+  if (!poll_while_busy (d))
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+           b->write ? "write" : "read", b->sector + d->done_cnt);
+  for (; d->done_cnt < end; d->done_cnt++)
+    {
+      void *sector = block_batch_buffer (b, d->done_cnt);
+      if (b->write)
+        output_sectors (c, sector, 1);
+      else
+        input_sectors (c, sector, 1);
+    }
+}
+
+/* Handles a completion interrupt for channel C's active disk. */
+static void
+complete_interrupt (struct channel *c)
+{
+  struct ata_disk *d = c->active;
+  struct ata_disk *other = &c->devices[1 - d->dev_no];
+  struct block_batch *b = d->batch;
+  uint8_t status;
+
+  status = inb (reg_status (c));        /* Acknowledge interrupt. */
+  if (status & STA_ERR)
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+           b->write ? "write" : "read", b->sector + d->done_cnt);
+
+  /* For a read, the interrupt says another block is ready.  For
+     a write, it says the disk took the last block we sent. */
+  if (!b->write)
+    transfer_block (d);
+  if (d->done_cnt < d->command_end)
+    {
+      if (b->write)
+        transfer_block (d);
+      return;
+    }
+
+  /* This command is done.  Start the next one, if the batch has
+     more sectors. */
+  if (d->done_cnt < b->cnt)
+    {
+      start_command (d);
+      return;
+    }
+
+  /* The batch is done.  Give the channel to the other disk if it
+     has a batch waiting, then report completion, which may start
+     another batch for this disk. */
+  d->batch = NULL;
+  c->active = NULL;
+  c->expecting_interrupt = false;
+  if (other->batch != NULL)
+    start_command (other);
+  block_batch_done (b);
 }
 
-static struct block_operations ide_operations =
-  {
-    ide_read,
-    ide_write
-  };
-
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT to the disk's sector selection and
+   sector count registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sectors (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_TRANSFER_SECTORS);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -414,20 +569,22 @@ issue_pio_command (struct channel *c, uint8_t command)
   outb (reg_command (c), command);
 }
 
-/* Reads a sector from channel C's data register in PIO mode into
-   SECTOR, which must have room for BLOCK_SECTOR_SIZE bytes. */
+/* Reads CNT sectors from channel C's data register in PIO mode
+   into SECTORS, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes. */
 static void
-input_sector (struct channel *c, void *sector) 
+input_sectors (struct channel *c, void *sectors, size_t cnt) 
 {
-  insw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  insw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
-/* Writes SECTOR to channel C's data register in PIO mode.
-   SECTOR must contain BLOCK_SECTOR_SIZE bytes. */
+/* Writes CNT sectors from SECTORS to channel C's data register
+   in PIO mode.  SECTORS must contain CNT * BLOCK_SECTOR_SIZE
+   bytes. */
 static void
-output_sector (struct channel *c, const void *sector) 
+output_sectors (struct channel *c, const void *sectors, size_t cnt) 
 {
-  outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  outsw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
 /* Low-level ATA primitives. */
@@ -479,6 +636,25 @@ wait_while_busy (const struct ata_disk *d)
   return false;
 }
 
+/* Busy-waits up to about 10 ms for disk D to clear BSY, and then
+   returns the status of the DRQ bit.  Unlike wait_while_busy(),
+   never sleeps, so it may be called from an interrupt handler.
+   A disk that is ready to move data clears BSY almost at once. */
+static bool
+poll_while_busy (const struct ata_disk *d) 
+{
+  struct channel *c = d->channel;
+  int i;
+
+  for (i = 0; i < 10000; i++)
+    {
+      if (!(inb (reg_alt_status (c)) & STA_BSY))
+        return (inb (reg_alt_status (c)) & STA_DRQ) != 0;
+      timer_udelay (1);
+    }
+  return false;
+}
+
 /* Program D's channel so that D is now the selected disk. */
 static void
 select_device (const struct ata_disk *d)
@@ -511,7 +687,9 @@ interrupt_handler (struct intr_frame *f)
   for (c = channels; c < channels + CHANNEL_CNT; c++)
     if (f->vec_no == c->irq)
       {
-        if (c->expecting_interrupt) 
+        if (c->active != NULL)
+          complete_interrupt (c);
+        else if (c->expecting_interrupt) 
           {
             inb (reg_status (c));               /* Acknowledge interrupt. */
             sema_up (&c->completion_wait);      /* Wake up waiter. */
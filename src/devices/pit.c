@@ -11,9 +11,6 @@
 #define PIT_PORT_CONTROL          0x43                /* Control port. */
 #define PIT_PORT_COUNTER(CHANNEL) (0x40 + (CHANNEL))  /* Counter port. */
 
-/* PIT cycles per second. */
-#define PIT_HZ 1193180
-
 /* Configure the given CHANNEL in the PIT.  In a PC, the PIT's
    three output channels are hooked up like this:
 
@@ -81,3 +78,36 @@ pit_configure_channel (int channel, int mode, int frequency)
   outb (PIT_PORT_COUNTER (channel), count >> 8);
   intr_set_level (old_level);
 }
+
+/* Starts channel 0 counting down from COUNT PIT cycles in mode 0,
+   which raises the interrupt line once, when the count runs out,
+   instead of periodically.  A COUNT of 0 is treated as 65536.
+   Use pit_configure_channel() to go back to periodic mode. */
+void
+pit_start_one_shot (uint16_t count)
+{
+  enum intr_level old_level;
+
+  old_level = intr_disable ();
+  outb (PIT_PORT_CONTROL, 0x30);
+  outb (PIT_PORT_COUNTER (0), count);
+  outb (PIT_PORT_COUNTER (0), count >> 8);
+  intr_set_level (old_level);
+}
+
+/* Returns the number of PIT cycles left in channel 0's current
+   count. */
+uint16_t
+pit_read_count (void)
+{
+  enum intr_level old_level;
+  uint8_t low, high;
+
+  old_level = intr_disable ();
+  outb (PIT_PORT_CONTROL, 0x00);        /* Latch channel 0's count. */
+  low = inb (PIT_PORT_COUNTER (0));
+  high = inb (PIT_PORT_COUNTER (0));
+  intr_set_level (old_level);
+
+  return low | (high << 8);
+}
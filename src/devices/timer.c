@@ -20,13 +20,47 @@
 /* Number of timer ticks since OS booted. */
 static int64_t ticks;
 
-/* Number of loops per timer tick.
-   Initialized by timer_calibrate(). */
-static unsigned loops_per_tick;
+/* The clocksource for sub-tick timing is the CPU's time-stamp
+   counter (TSC), which counts up once per CPU cycle. */
+static uint64_t tsc_base;       /* TSC at timer_init(). */
+static uint64_t tsc_hz;         /* TSC cycles per second, or 0 until
+                                   timer_calibrate() sets it. */
+
+/* Number of timer ticks over which to calibrate TSC_HZ. */
+#define CALIBRATE_TICKS 2
+
+/* Returns the current value of the TSC.
+   See [IA32-v2b] "RDTSC". */
+static inline uint64_t
+rdtsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+/* Tickless idle.  If TIMER_TICKLESS is true, then instead of
+   waking up for every timer tick while the CPU is idle, the PIT
+   is put in one-shot mode to interrupt at the tick when the next
+   sleeping thread is due.  The 16-bit PIT counter limits this to
+   MAX_ONE_SHOT_TICKS ticks at a time.  The one-shot interrupt
+   always lands on a tick boundary, so periodic mode resumes in
+   phase and no time is lost.  Controlled by kernel command-line
+   option "-tickless". */
+bool timer_tickless;
+
+/* PIT cycles per timer tick. */
+#define PIT_TICK_COUNT ((PIT_HZ + TIMER_FREQ / 2) / TIMER_FREQ)
+#define MAX_ONE_SHOT_TICKS (UINT16_MAX / PIT_TICK_COUNT)
+
+static int64_t one_shot_ticks;  /* Ticks the one-shot count spans, or 0. */
+static unsigned one_shot_count; /* PIT cycles in the one-shot count. */
+
+/* Statistics. */
+static long long interrupt_cnt; /* # of timer interrupts. */
 
 static intr_handler_func timer_interrupt;
-static bool too_many_loops (unsigned loops);
-static void busy_wait (int64_t loops);
+static void timer_tick (void);
 static void real_time_sleep (int64_t num, int32_t denom);
 static void real_time_delay (int64_t num, int32_t denom);
 
@@ -35,35 +69,36 @@ static void real_time_delay (int64_t num, int32_t denom);
 void
 timer_init (void) 
 {
+  tsc_base = rdtsc ();
   pit_configure_channel (0, 2, TIMER_FREQ);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 }
 
-/* Calibrates loops_per_tick, used to implement brief delays. */
+/* Calibrates tsc_hz, used to implement brief delays and
+   timer_ns(), by counting TSC cycles over CALIBRATE_TICKS timer
+   ticks. */
 void
 timer_calibrate (void) 
 {
-  unsigned high_bit, test_bit;
+  int64_t start;
+  uint64_t tsc_start;
 
   ASSERT (intr_get_level () == INTR_ON);
   printf ("Calibrating timer...  ");
 
-  /* Approximate loops_per_tick as the largest power-of-two
-     still less than one timer tick. */
-  loops_per_tick = 1u << 10;
-  while (!too_many_loops (loops_per_tick << 1)) 
-    {
-      loops_per_tick <<= 1;
-      ASSERT (loops_per_tick != 0);
-    }
+  /* Wait for a timer tick. */
+  start = ticks;
+  while (ticks == start)
+    barrier ();
 
-  /* Refine the next 8 bits of loops_per_tick. */
-  high_bit = loops_per_tick;
-  for (test_bit = high_bit >> 1; test_bit != high_bit >> 10; test_bit >>= 1)
-    if (!too_many_loops (loops_per_tick | test_bit))
-      loops_per_tick |= test_bit;
+  /* Count cycles until CALIBRATE_TICKS more ticks. */
+  start = ticks;
+  tsc_start = rdtsc ();
+  while (ticks < start + CALIBRATE_TICKS)
+    barrier ();
+  tsc_hz = (rdtsc () - tsc_start) * TIMER_FREQ / CALIBRATE_TICKS;
 
-  printf ("%'"PRIu64" loops/s.\n", (uint64_t) loops_per_tick * TIMER_FREQ);
+  printf ("%'"PRIu64" TSC cycles/s.\n", tsc_hz);
 }
 
 /* Returns the number of timer ticks since the OS booted. */
@@ -76,6 +111,23 @@ timer_ticks (void)
   return t;
 }
 
+/* Returns the number of nanoseconds since timer_init() was
+   called.  Before timer_calibrate(), the result is only as
+   precise as timer_ticks(). */
+uint64_t
+timer_ns (void)
+{
+  uint64_t cycles;
+
+  if (tsc_hz == 0)
+    return timer_ticks () * (1000000000 / TIMER_FREQ);
+
+  /* Divide before multiplying, to avoid overflow. */
+  cycles = rdtsc () - tsc_base;
+  return (cycles / tsc_hz * 1000000000
+          + cycles % tsc_hz * 1000000000 / tsc_hz);
+}
+
 /* Returns the number of timer ticks elapsed since THEN, which
    should be a value once returned by timer_ticks(). */
 int64_t
@@ -162,70 +214,107 @@ timer_ndelay (int64_t ns)
   real_time_delay (ns, 1000 * 1000 * 1000);
 }
 
+/* Called by the idle thread, with interrupts off, just before it
+   halts the CPU.  In tickless mode, stops the periodic timer
+   interrupt until the next sleeping thread is due. */
+void
+timer_idle_enter (void)
+{
+  int64_t idle_ticks;
+  unsigned elapsed;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (!timer_tickless || one_shot_ticks != 0)
+    return;
+
+  idle_ticks = thread_next_wake_tick () - ticks;
+  if (idle_ticks <= 1)
+    return;
+  if (idle_ticks > MAX_ONE_SHOT_TICKS)
+    idle_ticks = MAX_ONE_SHOT_TICKS;
+
+  /* Part of the current tick has already gone by.  In mode 2
+     the counter runs down from PIT_TICK_COUNT. */
+  elapsed = PIT_TICK_COUNT - pit_read_count ();
+  if (elapsed >= PIT_TICK_COUNT)
+    return;
+
+  one_shot_ticks = idle_ticks;
+  one_shot_count = idle_ticks * PIT_TICK_COUNT - elapsed;
+  pit_start_one_shot (one_shot_count);
+}
+
+/* Called with interrupts off when the idle thread stops running.
+   If another interrupt woke the CPU before the one-shot count
+   ran out, cuts the count short at the next tick boundary, so
+   that the periodic interrupt resumes from there.  The ticks
+   that have gone by are added when that interrupt arrives. */
+void
+timer_idle_exit (void)
+{
+  unsigned left;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (one_shot_ticks == 0)
+    return;
+
+  /* Once the count runs out, the counter wraps around and keeps
+     going, and the interrupt is already pending. */
+  left = pit_read_count ();
+  if (left == 0 || left > one_shot_count)
+    return;
+
+  /* The count ends on a tick boundary, so the boundaries still
+     ahead are where LEFT is a multiple of PIT_TICK_COUNT.  The
+     next of them ends the new count and is credited with the
+     ticks already gone by. */
+  one_shot_ticks -= (left - 1) / PIT_TICK_COUNT;
+  one_shot_count = (left - 1) % PIT_TICK_COUNT + 1;
+  pit_start_one_shot (one_shot_count);
+}
+
 /* Prints timer statistics. */
 void
 timer_print_stats (void) 
 {
   printf ("Timer: %"PRId64" ticks\n", timer_ticks ());
+  if (timer_tickless)
+    printf ("Timer: %lld interrupts\n", interrupt_cnt);
 }
 
-/* Timer interrupt handler. */
+/* Timer interrupt handler.  At the end of a one-shot count,
+   accounts for every tick it spanned and resumes the periodic
+   interrupt. */
 static void
 timer_interrupt (struct intr_frame *args UNUSED)
 {
-  ticks++;
-
-  if (thread_mlfqs)
+  interrupt_cnt++;
+  if (one_shot_ticks != 0)
     {
-      mlfqs_up_recent_cpu ();
-
-      if (ticks % 4 == 0)
-        {
-          mlfqs_all_set_priority ();
-
-          if (ticks % TIMER_FREQ == 0)
-            {
-              mlfqs_set_load_avg ();
-              mlfqs_all_set_recent_cpu ();
-            }
-        }
-    }
+      int64_t i;
 
-  thread_awake (ticks);
-  thread_tick ();
+      pit_configure_channel (0, 2, TIMER_FREQ);
+      for (i = 0; i < one_shot_ticks; i++)
+        timer_tick ();
+      one_shot_ticks = 0;
+    }
+  else
+    timer_tick ();
 }
 
-/* Returns true if LOOPS iterations waits for more than one timer
-   tick, otherwise false. */
-static bool
-too_many_loops (unsigned loops) 
+/* Advances the time by one tick. */
+static void
+timer_tick (void)
 {
-  /* Wait for a timer tick. */
-  int64_t start = ticks;
-  while (ticks == start)
-    barrier ();
-
-  /* Run LOOPS loops. */
-  start = ticks;
-  busy_wait (loops);
-
-  /* If the tick count changed, we iterated too long. */
-  barrier ();
-  return start != ticks;
-}
+  ticks++;
 
-/* Iterates through a simple loop LOOPS times, for implementing
-   brief delays.
+  if (thread_mlfqs)
+    mlfqs_tick (ticks);
 
-   Marked NO_INLINE because code alignment can significantly
-   affect timings, so that if this function was inlined
-   differently in different places the results would be difficult
-   to predict. */
-static void NO_INLINE
-busy_wait (int64_t loops) 
-{
-  while (loops-- > 0)
-    barrier ();
+  thread_awake (ticks);
+  thread_tick ();
 }
 
 /* Sleep for approximately NUM/DENOM seconds. */
@@ -260,8 +349,15 @@ real_time_sleep (int64_t num, int32_t denom)
 static void
 real_time_delay (int64_t num, int32_t denom)
 {
-  /* Scale the numerator and denominator down by 1000 to avoid
-     the possibility of overflow. */
-  ASSERT (denom % 1000 == 0);
-  busy_wait (loops_per_tick * num / 1000 * TIMER_FREQ / (denom / 1000)); 
+  uint64_t start = rdtsc ();
+  uint64_t cycles;
+
+  if (num <= 0)
+    return;
+
+  /* Convert NUM/DENOM seconds into TSC cycles, dividing before
+     multiplying to avoid overflow. */
+  cycles = num / denom * tsc_hz + num % denom * tsc_hz / denom;
+  while (rdtsc () - start < cycles)
+    barrier ();
 }
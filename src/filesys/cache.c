@@ -0,0 +1,491 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Buffer cache.
+
+   Keeps up to CACHE_SIZE sectors of the file system device in
+   memory.  Lookups go through a hash table keyed on sector
+   number, replacement uses the clock algorithm, and writes only
+   mark a sector dirty: dirty sectors reach the disk when they
+   are evicted, when the write-behind thread wakes up every
+   CACHE_FLUSH_INTERVAL ticks, or when cache_done() is called at
+   shutdown.
+
+   A second kernel thread performs read-ahead: sectors queued
+   with cache_readahead() are loaded into the cache in the
+   background, so that a sequential reader finds them already
+   there by the time it asks for them.
+
+   Flushing and read-ahead submit all of their transfers to the
+   disk before waiting for any, so the block layer can merge
+   adjacent sectors into single requests. */
+
+/* Number of sectors held in the cache. */
+#define CACHE_SIZE 64
+
+/* Timer ticks between periodic write-behind flushes. */
+#define CACHE_FLUSH_INTERVAL TIMER_FREQ
+
+/* Maximum number of sectors waiting for the read-ahead thread.
+   Requests beyond this are dropped. */
+#define READAHEAD_QUEUE_SIZE 32
+
+/* Largest read-ahead window accepted, in sectors.  Reading
+   further ahead than this would just evict sectors that were
+   prefetched earlier before they could be used. */
+#define READAHEAD_WINDOW_MAX (CACHE_SIZE / 4)
+
+/* A cached sector. */
+struct cache_entry
+  {
+    struct hash_elem elem;              /* Element in cache_map. */
+    block_sector_t sector;              /* Sector held, if in_use. */
+    bool in_use;                        /* Assigned to a sector? */
+    bool accessed;                      /* Used since the clock hand
+                                           last passed? */
+    bool prefetched;                    /* Loaded by read-ahead and not
+                                           yet used? */
+    int pin_cnt;                        /* Users; not evictable if >0. */
+
+    struct lock lock;                   /* Protects members below. */
+    bool valid;                         /* Does DATA hold SECTOR? */
+    bool dirty;                         /* Must DATA be written back? */
+    struct bio bio;                     /* Transfer in progress. */
+    struct bio_vec vec;                 /* BIO's only buffer, DATA. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+static struct cache_entry cache[CACHE_SIZE];
+
+/* Entries that are in use, keyed on sector.
+   cache_lock protects cache_map, clock_hand and the in_use,
+   sector, accessed, prefetched and pin_cnt members of every
+   entry. */
+static struct hash cache_map;
+static struct lock cache_lock;
+static size_t clock_hand;
+
+/* Read-ahead queue, a circular buffer of sectors to prefetch.
+   Protected by readahead_lock. */
+static block_sector_t readahead_queue[READAHEAD_QUEUE_SIZE];
+static size_t readahead_head;           /* Index of oldest request. */
+static size_t readahead_cnt;            /* Number of queued requests. */
+static struct lock readahead_lock;
+static struct condition readahead_queued;
+
+/* Number of sectors that file_read() asks to be read ahead of a
+   sequential reader.  Set with the kernel command-line option
+   "-ra". */
+size_t cache_readahead_window = 8;
+
+/* Statistics. */
+static long long hit_cnt;               /* Lookups found in cache. */
+static long long miss_cnt;              /* Lookups that went to disk. */
+static long long writeback_cnt;         /* Dirty sectors written back. */
+static long long prefetch_cnt;          /* Sectors read by read-ahead. */
+static long long prefetch_hit_cnt;      /* ...later used by a lookup. */
+static long long prefetch_waste_cnt;    /* ...evicted without use. */
+
+static void cache_put (struct cache_entry *);
+static thread_func flush_daemon NO_RETURN;
+static thread_func readahead_daemon NO_RETURN;
+
+static unsigned
+cache_hash_func (const struct hash_elem *e_, void *aux UNUSED)
+{
+  const struct cache_entry *e = hash_entry (e_, struct cache_entry, elem);
+  return hash_int (e->sector);
+}
+
+static bool
+cache_less_func (const struct hash_elem *a_, const struct hash_elem *b_,
+                 void *aux UNUSED)
+{
+  const struct cache_entry *a = hash_entry (a_, struct cache_entry, elem);
+  const struct cache_entry *b = hash_entry (b_, struct cache_entry, elem);
+  return a->sector < b->sector;
+}
+
+/* Initializes the buffer cache and starts the write-behind and
+   read-ahead threads. */
+void
+cache_init (void)
+{
+  size_t i;
+
+  lock_init (&cache_lock);
+  hash_init (&cache_map, cache_hash_func, cache_less_func, NULL);
+  for (i = 0; i < CACHE_SIZE; i++)
+    lock_init (&cache[i].lock);
+
+  lock_init (&readahead_lock);
+  cond_init (&readahead_queued);
+  if (cache_readahead_window > READAHEAD_WINDOW_MAX)
+    cache_readahead_window = READAHEAD_WINDOW_MAX;
+
+  thread_create ("cache-flush", PRI_DEFAULT, flush_daemon, NULL);
+  thread_create ("read-ahead", PRI_DEFAULT, readahead_daemon, NULL);
+}
+
+/* Writes every dirty sector back to disk.  Called when the file
+   system shuts down. */
+void
+cache_done (void)
+{
+  cache_flush ();
+}
+
+/* Returns the in-use entry for SECTOR, or a null pointer if
+   SECTOR is not cached.  cache_lock must be held. */
+static struct cache_entry *
+cache_lookup (block_sector_t sector)
+{
+  struct cache_entry key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&cache_map, &key.elem);
+  return e != NULL ? hash_entry (e, struct cache_entry, elem) : NULL;
+}
+
+/* Advances the clock hand until it finds an entry that may be
+   reused, giving each recently accessed entry a second chance.
+   Returns a null pointer if every entry is pinned.
+   cache_lock must be held. */
+static struct cache_entry *
+cache_select_victim (void)
+{
+  size_t i;
+
+  for (i = 0; i < 2 * CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[clock_hand];
+      clock_hand = (clock_hand + 1) % CACHE_SIZE;
+
+      if (!e->in_use)
+        return e;
+      if (e->pin_cnt > 0)
+        continue;
+      if (e->accessed)
+        e->accessed = false;
+      else
+        return e;
+    }
+  return NULL;
+}
+
+/* Returns the entry for SECTOR, pinned and with its lock held.
+   If LOAD is true, the entry's data is read from disk if it is
+   not already valid; otherwise the caller is about to overwrite
+   the whole sector and must set VALID itself.
+
+   If PREFETCH is true, the caller is the read-ahead thread: if
+   SECTOR is already cached, returns a null pointer without doing
+   anything, and otherwise the new entry is marked as prefetched
+   so that its first real use can be counted. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool load, bool prefetch)
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  for (;;)
+    {
+      e = cache_lookup (sector);
+      if (e != NULL)
+        {
+          if (prefetch)
+            {
+              lock_release (&cache_lock);
+              return NULL;
+            }
+          hit_cnt++;
+          if (e->prefetched)
+            {
+              prefetch_hit_cnt++;
+              e->prefetched = false;
+            }
+          break;
+        }
+
+      e = cache_select_victim ();
+      if (e != NULL && e->in_use && e->dirty)
+        {
+          /* Write E back before reusing it, as cache_flush()
+             does, with cache_lock released so that other lookups
+             need not wait for the disk.  E stays in cache_map
+             under its old sector, pinned, and its lock is held for
+             the write, so a lookup of that sector waits for the
+             write on E instead of rereading the stale sector from
+             disk.  Reading DIRTY without E's lock is only a hint;
+             it is rechecked below.  E may be used again while it
+             is written, so then look for a victim afresh. */
+          e->pin_cnt++;
+          lock_release (&cache_lock);
+
+          lock_acquire (&e->lock);
+          if (e->dirty)
+            {
+              block_write (fs_device, e->sector, e->data);
+              e->dirty = false;
+              writeback_cnt++;
+            }
+          cache_put (e);
+
+          lock_acquire (&cache_lock);
+          continue;
+        }
+      if (e != NULL)
+        {
+          if (prefetch)
+            prefetch_cnt++;
+          else
+            miss_cnt++;
+          if (e->in_use)
+            {
+              if (e->prefetched)
+                prefetch_waste_cnt++;
+              hash_delete (&cache_map, &e->elem);
+            }
+          e->in_use = true;
+          e->sector = sector;
+          e->prefetched = prefetch;
+          e->valid = false;
+          e->dirty = false;
+          hash_insert (&cache_map, &e->elem);
+          break;
+        }
+
+      /* Every entry is pinned.  Let the users finish. */
+      lock_release (&cache_lock);
+      thread_yield ();
+      lock_acquire (&cache_lock);
+    }
+  e->pin_cnt++;
+  e->accessed = true;
+  lock_release (&cache_lock);
+
+  lock_acquire (&e->lock);
+  if (load && !e->valid)
+    {
+      block_read (fs_device, sector, e->data);
+      e->valid = true;
+    }
+  return e;
+}
+
+/* Releases entry E, obtained from cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+
+  lock_acquire (&cache_lock);
+  ASSERT (e->pin_cnt > 0);
+  e->pin_cnt--;
+  lock_release (&cache_lock);
+}
+
+/* Starts writing entry E's data to disk, or reading it from
+   disk if WRITE is false, and returns without waiting.  The
+   caller must have E pinned and hold its lock, and must call
+   bio_wait() on E's bio before releasing it. */
+static void
+cache_submit (struct cache_entry *e, bool write)
+{
+  e->vec.buffer = e->data;
+  e->vec.cnt = 1;
+  e->bio.sector = e->sector;
+  e->bio.write = write;
+  e->bio.vec = &e->vec;
+  e->bio.vec_cnt = 1;
+  e->bio.end = NULL;
+  block_submit (fs_device, &e->bio);
+}
+
+/* Reads sector SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within sector
+   SECTOR into BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer, int ofs, int size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, true, false);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER into sector
+   SECTOR. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER at byte offset OFS within
+   sector SECTOR.  The sector is read from disk first unless the
+   write covers all of it. */
+void
+cache_write_at (block_sector_t sector, const void *buffer, int ofs, int size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE, false);
+  memcpy (e->data + ofs, buffer, size);
+  e->valid = true;
+  e->dirty = true;
+  cache_put (e);
+}
+
+/* Asks the read-ahead thread to load SECTOR into the cache in
+   the background.  The request is silently dropped if too many
+   are already pending. */
+void
+cache_readahead (block_sector_t sector)
+{
+  lock_acquire (&readahead_lock);
+  if (readahead_cnt < READAHEAD_QUEUE_SIZE)
+    {
+      size_t tail = (readahead_head + readahead_cnt) % READAHEAD_QUEUE_SIZE;
+      readahead_queue[tail] = sector;
+      readahead_cnt++;
+      cond_signal (&readahead_queued, &readahead_lock);
+    }
+  lock_release (&readahead_lock);
+}
+
+/* Writes every dirty sector in the cache back to disk. */
+void
+cache_flush (void)
+{
+  struct cache_entry *writing[CACHE_SIZE];
+  size_t write_cnt = 0;
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+
+      /* Reading DIRTY without E's lock is only a hint; it is
+         rechecked below. */
+      lock_acquire (&cache_lock);
+      if (!e->in_use || !e->dirty)
+        {
+          lock_release (&cache_lock);
+          continue;
+        }
+      e->pin_cnt++;
+      lock_release (&cache_lock);
+
+      lock_acquire (&e->lock);
+      if (e->dirty)
+        {
+          cache_submit (e, true);
+          writing[write_cnt++] = e;
+        }
+      else
+        cache_put (e);
+    }
+
+  for (i = 0; i < write_cnt; i++)
+    {
+      struct cache_entry *e = writing[i];
+
+      bio_wait (&e->bio);
+      e->dirty = false;
+      writeback_cnt++;
+      cache_put (e);
+    }
+}
+
+/* Write-behind thread.  Periodically flushes dirty sectors so
+   that little is lost if the machine stops unexpectedly and so
+   that eviction rarely has to wait for a write. */
+static void
+flush_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_sleep (CACHE_FLUSH_INTERVAL);
+      cache_flush ();
+    }
+}
+
+/* Read-ahead thread.  Loads the sectors queued by
+   cache_readahead() into the cache, while the threads that
+   queued them keep running.  Takes up to READAHEAD_WINDOW_MAX
+   queued sectors at a time and keeps all of their reads in
+   flight at once. */
+static void
+readahead_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      block_sector_t sectors[READAHEAD_WINDOW_MAX];
+      struct cache_entry *reading[READAHEAD_WINDOW_MAX];
+      size_t sector_cnt = 0;
+      size_t read_cnt = 0;
+      size_t i;
+
+      lock_acquire (&readahead_lock);
+      while (readahead_cnt == 0)
+        cond_wait (&readahead_queued, &readahead_lock);
+      while (readahead_cnt > 0 && sector_cnt < READAHEAD_WINDOW_MAX)
+        {
+          sectors[sector_cnt++] = readahead_queue[readahead_head];
+          readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_SIZE;
+          readahead_cnt--;
+        }
+      lock_release (&readahead_lock);
+
+      for (i = 0; i < sector_cnt; i++)
+        {
+          struct cache_entry *e = cache_get (sectors[i], false, true);
+          if (e != NULL)
+            {
+              cache_submit (e, false);
+              reading[read_cnt++] = e;
+            }
+        }
+
+      for (i = 0; i < read_cnt; i++)
+        {
+          struct cache_entry *e = reading[i];
+
+          bio_wait (&e->bio);
+          e->valid = true;
+          cache_put (e);
+        }
+    }
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  printf ("Cache: %lld hits, %lld misses, %lld write-backs\n",
+          hit_cnt, miss_cnt, writeback_cnt);
+  printf ("Read-ahead: %lld sectors prefetched, %lld used, "
+          "%lld evicted unused\n",
+          prefetch_cnt, prefetch_hit_cnt, prefetch_waste_cnt);
+}
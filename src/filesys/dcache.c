@@ -0,0 +1,191 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Maximum number of cached names. */
+#define DCACHE_SIZE 256
+
+/* A cached directory entry: the result of looking up NAME in the
+   directory whose inode is in sector DIR.  A negative entry
+   records that DIR has no entry named NAME.
+
+   The cache never reads directories itself.  Callers look a name
+   up here first and, on a miss, search the directory and record
+   what they found.  Callers must hold the directory's lock (see
+   inode_lock_dir()) across both steps and while changing the
+   directory, so that the cache never records a stale result. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dcache_map. */
+    struct list_elem lru_elem;          /* Element in dcache_lru. */
+    block_sector_t dir;                 /* Directory inode sector. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    bool positive;                      /* Does the entry exist? */
+    block_sector_t inode_sector;        /* Entry's inode, if positive. */
+    off_t ofs;                          /* Entry's offset in DIR, if positive. */
+  };
+
+static struct hash dcache_map;          /* All dentries, by DIR and name. */
+static struct list dcache_lru;          /* All dentries, most recent first. */
+static size_t dcache_cnt;               /* Number of dentries. */
+static struct lock dcache_lock;         /* Protects all of the above. */
+
+/* Returns a hash value for dentry E. */
+static unsigned
+dentry_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less_func (const struct hash_elem *a_, const struct hash_elem *b_,
+                  void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void)
+{
+  hash_init (&dcache_map, dentry_hash_func, dentry_less_func, NULL);
+  list_init (&dcache_lru);
+  lock_init (&dcache_lock);
+}
+
+/* Returns the dentry for NAME in DIR, or a null pointer if there
+   is none.  Must be called with dcache_lock held. */
+static struct dentry *
+find_dentry (block_sector_t dir, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache_map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Looks up NAME in directory DIR.  If the result is cached,
+   returns true and sets *FOUND to whether DIR has an entry named
+   NAME, in which case also sets *INODE_SECTOR and *OFS to that
+   entry's inode sector and byte offset within DIR.  Returns
+   false if the cache knows nothing about NAME in DIR. */
+bool
+dcache_lookup (block_sector_t dir, const char *name, bool *found,
+               block_sector_t *inode_sector, off_t *ofs)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return false;
+
+  lock_acquire (&dcache_lock);
+  d = find_dentry (dir, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&dcache_lru, &d->lru_elem);
+      *found = d->positive;
+      *inode_sector = d->inode_sector;
+      *ofs = d->ofs;
+    }
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Records the result of looking up NAME in DIR, replacing any
+   earlier result.  Evicts the least recently used dentry if the
+   cache is full. */
+static void
+record (block_sector_t dir, const char *name, bool positive,
+        block_sector_t inode_sector, off_t ofs)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find_dentry (dir, name);
+  if (d != NULL)
+    list_remove (&d->lru_elem);
+  else if (dcache_cnt >= DCACHE_SIZE)
+    {
+      d = list_entry (list_pop_back (&dcache_lru), struct dentry, lru_elem);
+      hash_delete (&dcache_map, &d->hash_elem);
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dcache_map, &d->hash_elem);
+    }
+  else
+    {
+      d = malloc (sizeof *d);
+      if (d == NULL)
+        {
+          lock_release (&dcache_lock);
+          return;
+        }
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dcache_map, &d->hash_elem);
+      dcache_cnt++;
+    }
+  d->positive = positive;
+  d->inode_sector = inode_sector;
+  d->ofs = ofs;
+  list_push_front (&dcache_lru, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Records that directory DIR has an entry NAME for the inode in
+   INODE_SECTOR, at byte offset OFS within DIR. */
+void
+dcache_add (block_sector_t dir, const char *name,
+            block_sector_t inode_sector, off_t ofs)
+{
+  record (dir, name, true, inode_sector, ofs);
+}
+
+/* Records that directory DIR has no entry NAME. */
+void
+dcache_add_negative (block_sector_t dir, const char *name)
+{
+  record (dir, name, false, 0, 0);
+}
+
+/* Forgets everything cached about directory DIR.  Must be called
+   before a new directory is created in sector DIR, because the
+   sector may have held a directory that was since deleted. */
+void
+dcache_purge_dir (block_sector_t dir)
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&dcache_lock);
+  for (e = list_begin (&dcache_lru); e != list_end (&dcache_lru); e = next)
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      next = list_next (e);
+      if (d->dir == dir)
+        {
+          list_remove (&d->lru_elem);
+          hash_delete (&dcache_map, &d->hash_elem);
+          free (d);
+          dcache_cnt--;
+        }
+    }
+  lock_release (&dcache_lock);
+}
@@ -0,0 +1,16 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+#include "filesys/off_t.h"
+
+void dcache_init (void);
+bool dcache_lookup (block_sector_t dir, const char *name, bool *found,
+                    block_sector_t *inode_sector, off_t *ofs);
+void dcache_add (block_sector_t dir, const char *name,
+                 block_sector_t inode_sector, off_t ofs);
+void dcache_add_negative (block_sector_t dir, const char *name);
+void dcache_purge_dir (block_sector_t dir);
+
+#endif /* filesys/dcache.h */
@@ -1,5 +1,7 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include <round.h>
+#include "filesys/cache.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
@@ -9,6 +11,8 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    off_t next_pos;             /* Position after last file_read(). */
+    off_t readahead_end;        /* End of data already read ahead. */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -23,6 +27,8 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->next_pos = 0;
+      file->readahead_end = 0;
       return file;
     }
   else
@@ -64,12 +70,33 @@ file_get_inode (struct file *file)
    starting at the file's current position.
    Returns the number of bytes actually read,
    which may be less than SIZE if end of file is reached.
-   Advances FILE's position by the number of bytes read. */
+   Advances FILE's position by the number of bytes read.
+
+   If this read starts where the previous one ended, FILE is
+   being read sequentially, so the sectors that follow are
+   queued for read-ahead. */
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
+  bool sequential = file->pos == file->next_pos;
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
   file->pos += bytes_read;
+  file->next_pos = file->pos;
+
+  if (!sequential)
+    file->readahead_end = 0;
+  else if (bytes_read > 0)
+    {
+      off_t start = ROUND_UP (file->pos, BLOCK_SECTOR_SIZE);
+      off_t end = start + cache_readahead_window * BLOCK_SECTOR_SIZE;
+      if (start < file->readahead_end)
+        start = file->readahead_end;
+      if (start < end)
+        {
+          inode_read_ahead (file->inode, start, end - start);
+          file->readahead_end = end;
+        }
+    }
   return bytes_read;
 }
 
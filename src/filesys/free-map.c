@@ -1,22 +1,84 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdint.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Protects all of the above and below. */
+
+/* A maximal run of free sectors.
+
+   The free map bitmap is the authoritative record of which
+   sectors are free and is what gets stored on disk.  The extents
+   index the same information so that allocation need not scan
+   the bitmap.  Each extent can be looked up by its first sector
+   and by the sector just past its end, so that released sectors
+   merge with their neighbours in constant time, and sits in one
+   of SIZE_CLASS_CNT lists by the power of 2 of its length, so
+   that allocation finds a long enough extent without a search. */
+struct extent
+  {
+    struct hash_elem start_elem;     /* Element in by_start. */
+    struct hash_elem end_elem;       /* Element in by_end. */
+    struct list_elem size_elem;      /* Element in a size class. */
+    block_sector_t start;            /* First free sector. */
+    size_t length;                   /* Number of free sectors. */
+  };
+
+/* Free extents, by first sector and by the sector just past the
+   last. */
+static struct hash by_start;
+static struct hash by_end;
+
+/* Size class N holds the extents whose length is at least 2**N
+   and less than 2**(N+1).  Bit N of SIZE_CLASS_MASK is set if
+   class N is not empty. */
+#define SIZE_CLASS_CNT 32
+static struct list size_classes[SIZE_CLASS_CNT];
+static uint32_t size_class_mask;
+
+/* Extent that the next allocation tries first, so that
+   consecutive allocations land next to each other on disk.
+   Null if there is none. */
+static struct extent *cursor;
+
+/* True if memory ran out while indexing free sectors, so that
+   some free sectors are missing from the index.  The index is
+   then rebuilt from the bitmap before an allocation fails. */
+static bool index_incomplete;
+
+static void build_extents (void);
+static bool take_extent (size_t cnt, block_sector_t *sectorp);
+static void add_extent (block_sector_t sector, size_t cnt);
+static hash_hash_func extent_start_hash, extent_end_hash;
+static hash_less_func extent_start_less, extent_end_less;
 
 /* Initializes the free map. */
 void
 free_map_init (void) 
 {
+  size_t i;
+
+  lock_init (&free_map_lock);
+  if (!hash_init (&by_start, extent_start_hash, extent_start_less, NULL)
+      || !hash_init (&by_end, extent_end_hash, extent_end_less, NULL))
+    PANIC ("free extent index creation failed");
+  for (i = 0; i < SIZE_CLASS_CNT; i++)
+    list_init (&size_classes[i]);
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  build_extents ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
@@ -27,26 +89,305 @@ free_map_init (void)
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  block_sector_t sector;
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = take_extent (cnt, &sector);
+  if (!success && index_incomplete)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      build_extents ();
+      success = take_extent (cnt, &sector);
     }
-  if (sector != BITMAP_ERROR)
+  if (success)
+    {
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      if (free_map_file != NULL
+          && !bitmap_write_partial (free_map, free_map_file, sector, cnt))
+        {
+          bitmap_set_multiple (free_map, sector, cnt, false); 
+          add_extent (sector, cnt);
+          success = false;
+        }
+    }
+  lock_release (&free_map_lock);
+  if (success)
     *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  return success;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  bitmap_write_partial (free_map, free_map_file, sector, cnt);
+  add_extent (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Returns a hash value for extent E's first sector. */
+static unsigned
+extent_start_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct extent, start_elem)->start);
+}
+
+/* Returns true if extent A starts before extent B. */
+static bool
+extent_start_less (const struct hash_elem *a, const struct hash_elem *b,
+                   void *aux UNUSED)
+{
+  return (hash_entry (a, struct extent, start_elem)->start
+          < hash_entry (b, struct extent, start_elem)->start);
+}
+
+/* Returns a hash value for the sector just past extent E. */
+static unsigned
+extent_end_hash (const struct hash_elem *e_, void *aux UNUSED)
+{
+  const struct extent *e = hash_entry (e_, struct extent, end_elem);
+  return hash_int (e->start + e->length);
+}
+
+/* Returns true if extent A ends before extent B. */
+static bool
+extent_end_less (const struct hash_elem *a_, const struct hash_elem *b_,
+                 void *aux UNUSED)
+{
+  const struct extent *a = hash_entry (a_, struct extent, end_elem);
+  const struct extent *b = hash_entry (b_, struct extent, end_elem);
+  return a->start + a->length < b->start + b->length;
+}
+
+/* Returns the size class for an extent of LENGTH sectors, the
+   position of the most significant bit set in LENGTH. */
+static int
+size_class (size_t length)
+{
+  int class = 0;
+
+  ASSERT (length > 0);
+  while (length >>= 1)
+    class++;
+  return class;
+}
+
+/* Returns the free extent that starts at SECTOR, or a null
+   pointer if there is none. */
+static struct extent *
+extent_starting_at (block_sector_t sector)
+{
+  struct extent key;
+  struct hash_elem *e;
+
+  key.start = sector;
+  e = hash_find (&by_start, &key.start_elem);
+  return e != NULL ? hash_entry (e, struct extent, start_elem) : NULL;
+}
+
+/* Returns the free extent that ends just before SECTOR, or a
+   null pointer if there is none. */
+static struct extent *
+extent_ending_at (block_sector_t sector)
+{
+  struct extent key;
+  struct hash_elem *e;
+
+  key.start = sector;
+  key.length = 0;
+  e = hash_find (&by_end, &key.end_elem);
+  return e != NULL ? hash_entry (e, struct extent, end_elem) : NULL;
+}
+
+/* Adds E, with its START and LENGTH set, to the index. */
+static void
+index_extent (struct extent *e)
+{
+  int class = size_class (e->length);
+
+  hash_insert (&by_start, &e->start_elem);
+  hash_insert (&by_end, &e->end_elem);
+  list_push_back (&size_classes[class], &e->size_elem);
+  size_class_mask |= 1u << class;
+}
+
+/* Removes E from the index, so that its START and LENGTH may be
+   changed. */
+static void
+unindex_extent (struct extent *e)
+{
+  int class = size_class (e->length);
+
+  hash_delete (&by_start, &e->start_elem);
+  hash_delete (&by_end, &e->end_elem);
+  list_remove (&e->size_elem);
+  if (list_empty (&size_classes[class]))
+    size_class_mask &= ~(1u << class);
+}
+
+/* Removes E from the index and frees it. */
+static void
+delete_extent (struct extent *e)
+{
+  if (cursor == e)
+    cursor = NULL;
+  unindex_extent (e);
+  free (e);
+}
+
+/* Adds a new extent for the CNT sectors starting at SECTOR to
+   the index.  Without memory for it, the sectors stay free in
+   the bitmap, and the index is marked incomplete so that it is
+   rebuilt before an allocation fails for want of them. */
+static void
+insert_extent (block_sector_t sector, size_t cnt)
+{
+  struct extent *e = malloc (sizeof *e);
+
+  if (e == NULL)
+    {
+      index_incomplete = true;
+      return;
+    }
+  e->start = sector;
+  e->length = cnt;
+  index_extent (e);
+}
+
+/* Frees the extent whose START_ELEM is E. */
+static void
+free_extent (struct hash_elem *e, void *aux UNUSED)
+{
+  free (hash_entry (e, struct extent, start_elem));
+}
+
+/* Rebuilds the extent index from the free map bitmap. */
+static void
+build_extents (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t start = 0;
+  size_t i;
+
+  hash_clear (&by_end, NULL);
+  hash_clear (&by_start, free_extent);
+  for (i = 0; i < SIZE_CLASS_CNT; i++)
+    list_init (&size_classes[i]);
+  size_class_mask = 0;
+  cursor = NULL;
+  index_incomplete = false;
+
+  while ((start = bitmap_scan (free_map, start, 1, false)) != BITMAP_ERROR)
+    {
+      size_t end = bitmap_scan (free_map, start, 1, true);
+      if (end == BITMAP_ERROR)
+        end = size;
+      insert_extent (start, end - start);
+      start = end;
+    }
+}
+
+/* Returns a free extent of at least CNT sectors, or a null
+   pointer if there is none.  Any extent in a size class above
+   CNT's is long enough, so the search only has to look through
+   the extents of CNT's own class if there are none above it. */
+static struct extent *
+find_extent (size_t cnt)
+{
+  int class = size_class (cnt);
+  uint32_t above = class + 1 < SIZE_CLASS_CNT ? size_class_mask >> (class + 1) : 0;
+  struct list_elem *elem;
+
+  if (above != 0)
+    {
+      int fit = class + 1;
+      while ((above & 1) == 0)
+        {
+          above >>= 1;
+          fit++;
+        }
+      return list_entry (list_front (&size_classes[fit]), struct extent, size_elem);
+    }
+
+  for (elem = list_begin (&size_classes[class]);
+       elem != list_end (&size_classes[class]); elem = list_next (elem))
+    {
+      struct extent *e = list_entry (elem, struct extent, size_elem);
+      if (e->length >= cnt)
+        return e;
+    }
+  return NULL;
+}
+
+/* Finds CNT free consecutive sectors, removes them from the
+   extent index, and stores the first into *SECTORP.  Tries the
+   extent at the cursor first, so that consecutive allocations
+   are consecutive on disk, then any extent that is long enough.
+   Returns true if successful, false if no extent is long
+   enough. */
+static bool
+take_extent (size_t cnt, block_sector_t *sectorp)
+{
+  struct extent *e;
+
+  ASSERT (cnt > 0);
+  if (cursor != NULL && cursor->length >= cnt)
+    e = cursor;
+  else
+    {
+      e = find_extent (cnt);
+      if (e == NULL)
+        return false;
+    }
+
+  *sectorp = e->start;
+  if (e->length == cnt)
+    delete_extent (e);
+  else
+    {
+      unindex_extent (e);
+      e->start += cnt;
+      e->length -= cnt;
+      index_extent (e);
+      cursor = e;
+    }
+  return true;
+}
+
+/* Adds the CNT free sectors starting at SECTOR to the extent
+   index, merging them with the extents on either side if they
+   touch. */
+static void
+add_extent (block_sector_t sector, size_t cnt)
+{
+  struct extent *prev = extent_ending_at (sector);
+  struct extent *next = extent_starting_at (sector + cnt);
+
+  if (prev != NULL)
+    {
+      unindex_extent (prev);
+      prev->length += cnt;
+      if (next != NULL)
+        {
+          prev->length += next->length;
+          if (cursor == next)
+            cursor = prev;
+          delete_extent (next);
+        }
+      index_extent (prev);
+    }
+  else if (next != NULL)
+    {
+      unindex_extent (next);
+      next->start = sector;
+      next->length += cnt;
+      index_extent (next);
+    }
+  else
+    insert_extent (sector, cnt);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,6 +399,9 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  lock_acquire (&free_map_lock);
+  build_extents ();
+  lock_release (&free_map_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
@@ -72,14 +416,22 @@ free_map_close (void)
 void
 free_map_create (void) 
 {
+  struct file *file;
+
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  /* Write bitmap to file.  The first write allocates the file's
+     sectors, which must happen while free_map_file is still null
+     so that free_map_allocate() does not try to write the free
+     map into a file that is itself being allocated.  The second
+     write records those allocations.  Afterward every sector of
+     the file exists, so writing the free map never allocates. */
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  if (!bitmap_write (free_map, file) || !bitmap_write (free_map, file))
     PANIC ("can't write free map");
+  free_map_file = file;
 }
@@ -0,0 +1,121 @@
+/* Puts up to 2,000 threads to sleep at once, with wake-up times
+   spread over 100 ticks, and measures how much slower a busy
+   loop runs while they sleep.  Since the busy loop is only
+   interrupted by the timer, the slowdown is the extra cost of
+   the timer interrupt with that many sleepers, which should be
+   close to zero.  Also verifies that no thread wakes up early.
+
+   The measurements vary from run to run, so they are printed
+   but not checked. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+#define SLEEPER_CNT 2000        /* Number of sleepers to create. */
+#define WAKE_SPREAD 100         /* Ticks over which they wake. */
+#define SPIN_TICKS 20           /* Ticks to run the busy loop. */
+
+/* Information about the test. */
+struct stress_test
+  {
+    int64_t wake_base;          /* First wake-up time. */
+    struct semaphore done;      /* Upped by each sleeper on waking. */
+    int early_cnt;              /* Number of early wake-ups. */
+  };
+
+/* Information about an individual sleeper. */
+struct sleeper
+  {
+    struct stress_test *test;
+    int64_t wake_tick;          /* When to wake up. */
+  };
+
+static struct sleeper sleepers[SLEEPER_CNT];
+
+static thread_func sleeper;
+static long long spin_rate (void);
+
+void
+test_alarm_stress (void)
+{
+  struct stress_test test;
+  long long idle_rate, loaded_rate;
+  int sleeper_cnt;
+  int i;
+
+  /* This test does not work with the MLFQS. */
+  ASSERT (!thread_mlfqs);
+
+  msg ("Measuring busy loop with no sleepers.");
+  idle_rate = spin_rate ();
+
+  /* Sleepers run at a higher priority than this thread, so each
+     one goes to sleep as soon as it is created. */
+  test.wake_base = timer_ticks () + 200;
+  sema_init (&test.done, 0);
+  test.early_cnt = 0;
+  for (sleeper_cnt = 0; sleeper_cnt < SLEEPER_CNT; sleeper_cnt++)
+    {
+      struct sleeper *s = &sleepers[sleeper_cnt];
+      char name[16];
+
+      s->test = &test;
+      s->wake_tick = test.wake_base + (sleeper_cnt * 37) % WAKE_SPREAD;
+      snprintf (name, sizeof name, "sleeper %d", sleeper_cnt);
+      if (thread_create (name, PRI_DEFAULT + 1, sleeper, s) == TID_ERROR)
+        break;
+    }
+  if (sleeper_cnt < SLEEPER_CNT / 2)
+    fail ("only created %d sleepers", sleeper_cnt);
+
+  msg ("Measuring busy loop with sleepers.");
+  if (timer_ticks () + SPIN_TICKS + 2 >= test.wake_base)
+    fail ("creating sleepers took too long");
+  loaded_rate = spin_rate ();
+
+  for (i = 0; i < sleeper_cnt; i++)
+    sema_down (&test.done);
+  if (test.early_cnt != 0)
+    fail ("%d sleepers woke up early", test.early_cnt);
+
+  msg ("%d sleepers: %lld iterations per tick, against %lld with none.",
+       sleeper_cnt, loaded_rate, idle_rate);
+  if (loaded_rate < idle_rate)
+    msg ("Timer interrupt overhead: %lld.%lld%% of each tick.",
+         (idle_rate - loaded_rate) * 100 / idle_rate,
+         (idle_rate - loaded_rate) * 1000 / idle_rate % 10);
+  msg ("PASS");
+}
+
+/* Sleeper thread. */
+static void
+sleeper (void *s_)
+{
+  struct sleeper *s = s_;
+
+  timer_sleep (s->wake_tick - timer_ticks ());
+  if (timer_ticks () < s->wake_tick)
+    s->test->early_cnt++;
+  sema_up (&s->test->done);
+}
+
+/* Returns the average number of iterations of a busy loop run
+   in each of SPIN_TICKS timer ticks. */
+static long long
+spin_rate (void)
+{
+  int64_t start = timer_ticks ();
+  long long iterations = 0;
+
+  while (timer_ticks () == start)
+    barrier ();
+  start++;
+
+  while (timer_ticks () < start + SPIN_TICKS)
+    iterations++;
+  return iterations / SPIN_TICKS;
+}
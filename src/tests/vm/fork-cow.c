@@ -0,0 +1,71 @@
+/* Checks that memory shared copy-on-write after fork() stays
+   private to each process: the child writes one page directly
+   and another through the read() system call, the parent writes
+   a third, and neither process may see the other's writes. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+
+static char direct[PAGE_SIZE] __attribute__ ((aligned (PAGE_SIZE)));
+static char via_read[PAGE_SIZE] __attribute__ ((aligned (PAGE_SIZE)));
+static char parent_only[PAGE_SIZE] __attribute__ ((aligned (PAGE_SIZE)));
+
+/* Fails if any of the SIZE bytes at BUF is not VALUE. */
+static void
+check_fill (const char *name, const char *buf, size_t size, char value)
+{
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    if (buf[i] != value)
+      fail ("%s[%zu] is %02hhx instead of %02hhx", name, i, buf[i], value);
+}
+
+void
+test_main (void)
+{
+  size_t size = strlen (sample);
+  int handle;
+  pid_t pid;
+  int status;
+
+  /* Touch every page so that all three are resident and get
+     shared with the child. */
+  memset (direct, 'p', sizeof direct);
+  memset (via_read, 'p', sizeof via_read);
+  memset (parent_only, 'p', sizeof parent_only);
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  pid = fork ();
+  if (pid == 0)
+    {
+      memset (direct, 'c', sizeof direct);
+      if (read (handle, via_read, size) != (int) size)
+        fail ("child: read \"sample.txt\" failed");
+
+      check_fill ("direct", direct, PAGE_SIZE, 'c');
+      if (memcmp (via_read, sample, size))
+        fail ("child: read \"sample.txt\" returned bad data");
+      check_fill ("via_read + size", via_read + size, PAGE_SIZE - size,
+                  'p');
+      check_fill ("parent_only", parent_only, PAGE_SIZE, 'p');
+      msg ("child: writes are visible, parent's writes are not");
+      exit (0);
+    }
+
+  memset (parent_only, 'q', sizeof parent_only);
+  status = wait (pid);
+  if (pid == PID_ERROR || status != 0)
+    fail ("child failed");
+
+  check_fill ("direct", direct, PAGE_SIZE, 'p');
+  check_fill ("via_read", via_read, PAGE_SIZE, 'p');
+  check_fill ("parent_only", parent_only, PAGE_SIZE, 'q');
+  msg ("parent: child's writes are not visible");
+  close (handle);
+}
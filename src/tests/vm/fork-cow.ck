@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fork-cow) begin
+(fork-cow) open "sample.txt"
+(fork-cow) child: writes are visible, parent's writes are not
+(fork-cow) parent: child's writes are not visible
+(fork-cow) end
+EOF
+pass;
@@ -0,0 +1,49 @@
+/* Checks that a child created by fork() gets its own copy of
+   each open file descriptor, starting at the parent's position,
+   and that reads in the child do not move the parent's
+   position. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHUNK 16
+
+void
+test_main (void)
+{
+  char buf[CHUNK];
+  int handle;
+  pid_t pid;
+  int status;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  if (read (handle, buf, CHUNK) != CHUNK || memcmp (buf, sample, CHUNK))
+    fail ("read \"sample.txt\" returned bad data");
+
+  pid = fork ();
+  if (pid == 0)
+    {
+      if (tell (handle) != CHUNK)
+        fail ("child: position is %u, not %d", tell (handle), CHUNK);
+      if (read (handle, buf, CHUNK) != CHUNK
+          || memcmp (buf, sample + CHUNK, CHUNK))
+        fail ("child: read \"sample.txt\" returned bad data");
+      msg ("child: read continues at the parent's position");
+      exit (0);
+    }
+
+  status = wait (pid);
+  if (pid == PID_ERROR || status != 0)
+    fail ("child failed");
+
+  if (tell (handle) != CHUNK)
+    fail ("position is %u, not %d", tell (handle), CHUNK);
+  if (read (handle, buf, CHUNK) != CHUNK
+      || memcmp (buf, sample + CHUNK, CHUNK))
+    fail ("read \"sample.txt\" returned bad data");
+  msg ("parent: position unchanged by the child");
+  close (handle);
+}
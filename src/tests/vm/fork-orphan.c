@@ -0,0 +1,61 @@
+/* Checks that a process keeps running, with its memory intact,
+   after its parent exits.  The child forks a grandchild and
+   exits at once; the grandchild waits until the test has reaped
+   the child, checks its memory, and reports back by creating a
+   file. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (64 * 1024)
+
+static char buf[SIZE];
+
+/* Spins until a file named NAME exists. */
+static void
+wait_for_file (const char *name)
+{
+  int handle;
+
+  while ((handle = open (name)) == -1)
+    continue;
+  close (handle);
+}
+
+void
+test_main (void)
+{
+  pid_t pid;
+  int status;
+  size_t i;
+
+  memset (buf, 0x5a, sizeof buf);
+
+  pid = fork ();
+  if (pid == 0)
+    {
+      /* Child. */
+      if (fork () == 0)
+        {
+          /* Grandchild. */
+          wait_for_file ("reaped");
+          for (i = 0; i < SIZE; i++)
+            if (buf[i] != 0x5a)
+              fail ("grandchild: byte %zu != 0x5a", i);
+          msg ("grandchild: memory intact after parent exited");
+          if (!create ("done", 0))
+            fail ("grandchild: create \"done\" failed");
+          exit (0);
+        }
+      exit (0);
+    }
+
+  status = wait (pid);
+  if (pid == PID_ERROR || status != 0)
+    fail ("child failed");
+  CHECK (create ("reaped", 0), "create \"reaped\"");
+  wait_for_file ("done");
+  msg ("grandchild finished");
+}
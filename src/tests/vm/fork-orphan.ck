@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fork-orphan) begin
+(fork-orphan) create "reaped"
+(fork-orphan) grandchild: memory intact after parent exited
+(fork-orphan) grandchild finished
+(fork-orphan) end
+EOF
+pass;
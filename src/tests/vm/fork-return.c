@@ -0,0 +1,27 @@
+/* Forks a child and checks that fork() returns 0 in the child
+   and the child's pid in the parent, and that the parent can
+   wait for the child's exit code. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  pid_t pid = fork ();
+  int status;
+
+  if (pid == 0)
+    {
+      msg ("child: fork returned 0");
+      exit (81);
+    }
+
+  /* Don't print anything until the child has exited, so that
+     the output order does not depend on scheduling. */
+  status = wait (pid);
+  if (pid == PID_ERROR)
+    fail ("fork failed");
+  msg ("wait(child) = %d", status);
+}
@@ -0,0 +1,11 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fork-return) begin
+(fork-return) child: fork returned 0
+(fork-return) wait(child) = 81
+(fork-return) end
+EOF
+pass;
@@ -0,0 +1,57 @@
+/* Fills 1 MB of memory, more than fits in the user pool this
+   test runs with, so that much of it is swapped out, then forks
+   and checks that the child sees all of it. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (1024 * 1024)
+
+static char buf[SIZE];
+
+/* Returns the value expected at byte OFS of buf[]. */
+static char
+pattern (size_t ofs)
+{
+  return ofs % 251;
+}
+
+/* Fails if buf[] does not hold the expected pattern. */
+static void
+check_buf (const char *who)
+{
+  size_t i;
+
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != pattern (i))
+      fail ("%s: byte %zu is %02hhx instead of %02hhx",
+            who, i, buf[i], pattern (i));
+}
+
+void
+test_main (void)
+{
+  pid_t pid;
+  int status;
+  size_t i;
+
+  msg ("initialize");
+  for (i = 0; i < SIZE; i++)
+    buf[i] = pattern (i);
+
+  pid = fork ();
+  if (pid == 0)
+    {
+      check_buf ("child");
+      msg ("child: read pass");
+      exit (0);
+    }
+
+  status = wait (pid);
+  if (pid == PID_ERROR || status != 0)
+    fail ("child failed");
+  check_buf ("parent");
+  msg ("parent: read pass");
+}
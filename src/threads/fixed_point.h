@@ -1,23 +1,80 @@
+#ifndef THREADS_FIXED_POINT_H
+#define THREADS_FIXED_POINT_H
+
+#include <stdint.h>
+
+/* 17.14 fixed-point arithmetic.  These are called from the timer
+   interrupt, so they are inline. */
+
 #define f (1 << 14)
 
-int convert_fp (int);
+static inline int
+convert_fp (int n)
+{
+  return n * f;
+}
+
+static inline int
+convert_int (int x)
+{
+  return x / f;
+}
 
-int convert_int (int);
+static inline int
+convert_int_round (int x)
+{
+  if (x >= 0)
+    return (x + f / 2) / f;
+  else
+    return (x - f / 2) / f;
+}
 
-int convert_int_round (int);
+static inline int
+add_ff (int x, int y)
+{
+  return x + y;
+}
 
-int add_ff (int, int);
+static inline int
+sub_ff (int x, int y)
+{
+  return x - y;
+}
 
-int sub_ff (int, int);
+static inline int
+add_fi (int x, int n)
+{
+  return x + n * f;
+}
 
-int add_fi (int, int);
+static inline int
+sub_fi (int x, int n)
+{
+  return x - n * f;
+}
 
-int sub_fi (int, int);
+static inline int
+mult_ff (int x, int y)
+{
+  return ((int64_t) x) * y / f;
+}
 
-int mult_ff (int, int);
+static inline int
+mult_fi (int x, int n)
+{
+  return x * n;
+}
 
-int mult_fi (int, int);
+static inline int
+div_ff (int x, int y)
+{
+  return ((int64_t) x) * f / y;
+}
 
-int div_ff (int, int);
+static inline int
+div_fi (int x, int n)
+{
+  return x / n;
+}
 
-int div_fi (int, int);
+#endif /* threads/fixed_point.h */
@@ -3,8 +3,10 @@
 #include <debug.h>
 #include <stddef.h>
 #include <random.h>
+#include <round.h>
 #include <stdio.h>
 #include <string.h>
+#include "devices/timer.h"
 #include "threads/flags.h"
 #include "threads/interrupt.h"
 #include "threads/intr-stubs.h"
@@ -21,17 +23,30 @@
    of thread.h for details. */
 #define THREAD_MAGIC 0xcd6abf4b
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
-
-/* List of processes in THREAD_BLOCKED state put by timer_sleep function,
+/* Processes in THREAD_READY state, that is, processes that are
+   ready to run but not actually running.  There is one FIFO
+   queue per priority, and bit P of READY_MASK is set when
+   READY_QUEUES[P] is nonempty, so that the highest priority with
+   a ready process is found with a single bit scan. */
+#define PRI_CNT (PRI_MAX + 1)
+static struct list ready_queues[PRI_CNT];
+static uint32_t ready_mask[DIV_ROUND_UP (PRI_CNT, 32)];
+static size_t ready_cnt;                /* Number of ready processes. */
+
+/* Processes in THREAD_BLOCKED state put by timer_sleep function,
    that is, processes that are waiting for reaching a wake tick of
-   the thread. */
-static struct list sleep_list;
+   the thread.  They form a leftist heap ordered by wake tick,
+   rooted at SLEEP_HEAP, so that the timer interrupt only looks
+   at threads that are due and both inserting and removing a
+   thread take O(log n) time in the worst case.  Threads with the
+   same wake tick are woken in the order they went to sleep. */
+static struct thread *sleep_heap;
+static unsigned sleep_seq;              /* Stamps each sleeper. */
 
 /* List of all processes.  Processes are added to this list
-   when they are first scheduled and removed when they exit. */
+   when they are first scheduled and removed when they exit.
+   Under the MLFQS it is kept in order of decay_epoch; see
+   mlfqs_catch_up(). */
 static struct list all_list;
 
 /* Idle thread. */
@@ -66,12 +81,33 @@ static unsigned thread_ticks;   /* # of timer ticks since last yield. */
 bool thread_mlfqs;
 static int load_avg;
 
+/* The MLFQS decays every thread's recent_cpu once a second, by a
+   coefficient that depends on the load average.  Rather than
+   sweeping all threads from the timer interrupt, the running
+   thread is decayed on time, and every other thread only when it
+   is next examined: when it is unblocked, or chosen to run, or
+   reached by the few threads caught up on each tick, oldest
+   first.  MLFQS_EPOCH counts the decays so far, and each
+   thread's decay_epoch says how many it has had.  The most recent
+   coefficients are kept in DECAY_COEF, and the per-tick catch-up
+   keeps every thread within DECAY_HISTORY of the present. */
+#define DECAY_HISTORY 64                /* Coefficients remembered. */
+#define DECAY_PER_TICK 4                /* Threads caught up per tick. */
+static int mlfqs_epoch;
+static int decay_coef[DECAY_HISTORY];   /* Indexed by epoch % DECAY_HISTORY. */
+
 static void kernel_thread (thread_func *, void *aux);
 
 static void idle (void *aux UNUSED);
 static struct thread *running_thread (void);
 static struct thread *next_thread_to_run (void);
 static void init_thread (struct thread *, const char *name, int priority);
+static void ready_push (struct thread *);
+static void ready_remove (struct thread *);
+static int ready_max_priority (void);
+static struct thread *sleep_merge (struct thread *, struct thread *);
+static void mlfqs_catch_up (struct thread *);
+static void mlfqs_set_load_avg (void);
 static bool is_thread (struct thread *) UNUSED;
 static void *alloc_frame (struct thread *, size_t size);
 static void schedule (void);
@@ -94,11 +130,14 @@ static tid_t allocate_tid (void);
 void
 thread_init (void) 
 {
+  int i;
+
   ASSERT (intr_get_level () == INTR_OFF);
 
   lock_init (&tid_lock);
-  list_init (&ready_list);
-  list_init (&sleep_list);
+  for (i = 0; i < PRI_CNT; i++)
+    list_init (&ready_queues[i]);
+  sleep_heap = NULL;
   list_init (&all_list);
 
   /* Set up a thread structure for the running thread. */
@@ -167,34 +206,83 @@ thread_sleep (int64_t wake_tick)
   ASSERT (cur != idle_thread);
 
   cur->wake_tick = wake_tick;
-  list_push_back (&sleep_list, &cur->elem);
+  cur->sleep_seq = sleep_seq++;
+  cur->sleep_left = cur->sleep_right = NULL;
+  cur->sleep_rank = 1;
+  sleep_heap = sleep_merge (sleep_heap, cur);
   thread_block ();
 }
 
-/* Transitions a slept thread T to the ready-to-run state. */
+/* Transitions the slept threads whose wake tick has been
+   reached by TICKS to the ready-to-run state. */
 void
 thread_awake (int64_t ticks)
 {
   ASSERT (intr_get_level () == INTR_OFF);
 
-  if (list_empty (&sleep_list))
-    return;
-  else
+  while (sleep_heap != NULL && ticks >= sleep_heap->wake_tick)
     {
-      struct list_elem *e;
-      for (e = list_begin (&sleep_list); e != list_end (&sleep_list);
-           e = list_next (e))
-      {
-        struct thread *t = list_entry (e, struct thread, elem);
-        if (ticks >= t->wake_tick)
-          { 
-            e = list_prev (list_remove (&t->elem));
-            thread_unblock(t);
-          }
-      }
+      struct thread *t = sleep_heap;
+      sleep_heap = sleep_merge (t->sleep_left, t->sleep_right);
+      thread_unblock (t);
     }
 }
 
+/* Returns the tick at which the next sleeping thread is due, or
+   INT64_MAX if no thread is sleeping. */
+int64_t
+thread_next_wake_tick (void)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  return sleep_heap != NULL ? sleep_heap->wake_tick : INT64_MAX;
+}
+
+/* Returns true if sleeping thread A is due before B. */
+static bool
+sleep_before (const struct thread *a, const struct thread *b)
+{
+  if (a->wake_tick != b->wake_tick)
+    return a->wake_tick < b->wake_tick;
+  return (int) (a->sleep_seq - b->sleep_seq) < 0;
+}
+
+/* Returns the rank of leftist heap T: the length of its right
+   spine. */
+static int
+sleep_rank (const struct thread *t)
+{
+  return t != NULL ? t->sleep_rank : 0;
+}
+
+/* Merges sleep heaps A and B and returns the result. */
+static struct thread *
+sleep_merge (struct thread *a, struct thread *b)
+{
+  struct thread *tmp;
+
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (sleep_before (b, a))
+    {
+      tmp = a;
+      a = b;
+      b = tmp;
+    }
+
+  a->sleep_right = sleep_merge (a->sleep_right, b);
+  if (sleep_rank (a->sleep_left) < sleep_rank (a->sleep_right))
+    {
+      tmp = a->sleep_left;
+      a->sleep_left = a->sleep_right;
+      a->sleep_right = tmp;
+    }
+  a->sleep_rank = sleep_rank (a->sleep_right) + 1;
+  return a;
+}
+
 /* Creates a new kernel thread named NAME with the given initial
    PRIORITY, which executes FUNCTION passing AUX as the argument,
    and adds it to the ready queue.  Returns the thread identifier
@@ -300,7 +388,9 @@ thread_unblock (struct thread *t)
 
   old_level = intr_disable ();
   ASSERT (t->status == THREAD_BLOCKED);
-  list_insert_ordered (&ready_list, &t->elem, thread_priority_more, NULL);
+  if (thread_mlfqs)
+    mlfqs_catch_up (t);
+  ready_push (t);
   t->status = THREAD_READY;
   intr_set_level (old_level);
 }
@@ -376,7 +466,7 @@ thread_yield (void)
 
   old_level = intr_disable ();
   if (cur != idle_thread)
-    list_insert_ordered (&ready_list, &cur->elem, thread_priority_more, NULL);
+    ready_push (cur);
   cur->status = THREAD_READY;
   schedule ();
   intr_set_level (old_level);
@@ -402,18 +492,7 @@ thread_foreach (thread_action_func *func, void *aux)
 void
 thread_compare_and_yield (void)
 {
-  if (list_empty (&ready_list))
-    return;
-
-  struct thread *t = list_entry (list_begin (&ready_list), struct thread, elem);
-
-  if (thread_mlfqs)
-    {
-      if(thread_get_priority () < t->priority)
-        thread_yield ();
-    }
-
-  if (thread_get_priority () < t->visible_priority)
+  if (thread_get_priority () < ready_max_priority ())
     {
       if (intr_context ()) {
         intr_yield_on_return ();
@@ -423,10 +502,67 @@ thread_compare_and_yield (void)
     }
 }
 
+/* Returns the priority T is scheduled by. */
+static int
+sched_priority (const struct thread *t)
+{
+  return thread_mlfqs ? t->priority : t->visible_priority;
+}
+
+/* Adds T to the back of the ready queue for its priority. */
+static void
+ready_push (struct thread *t)
+{
+  int pri = sched_priority (t);
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  t->ready_priority = pri;
+  list_push_back (&ready_queues[pri], &t->elem);
+  ready_mask[pri / 32] |= 1u << (pri % 32);
+  ready_cnt++;
+}
+
+/* Removes T from its ready queue. */
+static void
+ready_remove (struct thread *t)
+{
+  int pri = t->ready_priority;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  list_remove (&t->elem);
+  if (list_empty (&ready_queues[pri]))
+    ready_mask[pri / 32] &= ~(1u << (pri % 32));
+  ready_cnt--;
+}
+
+/* Returns the highest priority of any ready thread, or -1 if no
+   thread is ready. */
+static int
+ready_max_priority (void)
+{
+  int i;
+
+  for (i = DIV_ROUND_UP (PRI_CNT, 32) - 1; i >= 0; i--)
+    if (ready_mask[i] != 0)
+      return i * 32 + 31 - __builtin_clz (ready_mask[i]);
+  return -1;
+}
+
+/* Moves T, if it is ready, to the ready queue for its current
+   priority.  Must be called whenever a ready thread's priority
+   changes. */
 void
-thread_sort_ready_list (void)
+thread_requeue (struct thread *t)
 {
-  list_sort (&ready_list, thread_priority_more, NULL);
+  enum intr_level old_level = intr_disable ();
+  if (t->status == THREAD_READY && t->ready_priority != sched_priority (t))
+    {
+      ready_remove (t);
+      ready_push (t);
+    }
+  intr_set_level (old_level);
 }
 
 void
@@ -537,25 +673,42 @@ void mlfqs_set_priority(struct thread *t)
   t->priority = tmp_priority;
 }
 
-void mlfqs_set_recent_cpu(struct thread *t)
+/* Applies to T's recent_cpu every once-a-second decay it has
+   missed, recomputes its priority, and moves it to the back of
+   all_list.  Interrupts must be off. */
+static void
+mlfqs_catch_up (struct thread *t)
 {
-  if (t == idle_thread)
-    return;
+  int epoch;
 
-  int tmp1 = mult_fi (load_avg, 2);
-  int tmp2 = div_ff (tmp1, add_fi (tmp1, 1));
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  for (epoch = t->decay_epoch + 1; epoch <= mlfqs_epoch; epoch++)
+    {
+      /* Should not happen, given the per-tick catch-up, but
+         reuse the oldest coefficient rather than a stale
+         slot. */
+      int e = epoch > mlfqs_epoch - DECAY_HISTORY ? epoch : mlfqs_epoch - DECAY_HISTORY + 1;
+      t->recent_cpu = add_fi (mult_ff (decay_coef[e % DECAY_HISTORY], t->recent_cpu),
+                              t->nice);
+    }
+  t->decay_epoch = mlfqs_epoch;
+  list_remove (&t->allelem);
+  list_push_back (&all_list, &t->allelem);
 
-  t->recent_cpu = add_fi (mult_ff (tmp2, t->recent_cpu), t->nice);
+  mlfqs_set_priority (t);
+  thread_requeue (t);
 }
 
-void mlfqs_set_load_avg(void)
+static void
+mlfqs_set_load_avg (void)
 {
   int executable_threads;
 
   if (thread_current () != idle_thread)
-    executable_threads = list_size (&ready_list) + 1;
+    executable_threads = ready_cnt + 1;
   else
-    executable_threads = list_size (&ready_list);
+    executable_threads = ready_cnt;
 
   int div_1_60 = div_fi (convert_fp (1), 60);
 
@@ -563,43 +716,43 @@ void mlfqs_set_load_avg(void)
                      mult_fi (div_1_60, executable_threads));
 }
 
-void mlfqs_up_recent_cpu(void)
+/* Does the MLFQS bookkeeping for timer tick TICKS, in O(1) time
+   however many threads there are.  Only the running thread's
+   recent_cpu changes between decays, so only its priority needs
+   recomputing every fourth tick. */
+void
+mlfqs_tick (int64_t ticks)
 {
-  if (thread_current () == idle_thread)
-    return;
+  struct thread *cur = thread_current ();
+  int i;
 
-  thread_current ()->recent_cpu = add_fi (thread_current ()->recent_cpu, 1);
-}
+  ASSERT (intr_context ());
 
-void mlfqs_all_set_priority(void)
-{
-  struct list_elem *e;
-  struct thread *t;
+  if (cur != idle_thread)
+    cur->recent_cpu = add_fi (cur->recent_cpu, 1);
 
-  for (e = list_begin (&all_list);
-       e != list_end (&all_list);
-       e = list_next (e))
+  if (ticks % TIMER_FREQ == 0)
     {
-      t = list_entry (e, struct thread, allelem);
-      mlfqs_set_priority (t);
-    }
-  thread_sort_ready_list ();
-}
+      int twice_load;
 
-void mlfqs_all_set_recent_cpu(void)
-{
-  struct list_elem *e;
-  struct thread *t;
+      mlfqs_set_load_avg ();
+      twice_load = mult_fi (load_avg, 2);
+      mlfqs_epoch++;
+      decay_coef[mlfqs_epoch % DECAY_HISTORY] = div_ff (twice_load, add_fi (twice_load, 1));
+      mlfqs_catch_up (cur);
+    }
+  else if (ticks % 4 == 0)
+    mlfqs_set_priority (cur);
 
-  for (e = list_begin (&all_list);
-       e != list_end (&all_list);
-       e = list_next (e))
+  for (i = 0; i < DECAY_PER_TICK; i++)
     {
-      t = list_entry (e, struct thread, allelem);
-      mlfqs_set_recent_cpu (t);
+      struct thread *t = list_entry (list_front (&all_list), struct thread, allelem);
+      if (t->decay_epoch == mlfqs_epoch)
+        break;
+      mlfqs_catch_up (t);
     }
 }
-
+
 /* Idle thread.  Executes when no other thread is ready to run.
 
    The idle thread is initially put on the ready list by
@@ -621,6 +774,7 @@ idle (void *idle_started_ UNUSED)
       /* Let someone else run. */
       intr_disable ();
       thread_block ();
+      timer_idle_enter ();
 
       /* Re-enable interrupts and wait for the next one.
 
@@ -689,6 +843,7 @@ init_thread (struct thread *t, const char *name, int priority)
   t->visible_priority = priority;
   t->nice = NICE_DEFAULT;
   t->recent_cpu = RECENT_CPU_DEFAULT;
+  t->decay_epoch = mlfqs_epoch;
   t->waiting_lock = NULL;
   t->magic = THREAD_MAGIC;
   list_init (&t->locks);
@@ -708,6 +863,7 @@ init_thread (struct thread *t, const char *name, int priority)
 
 #ifdef VM
   list_init (&t->mmap_list);
+  t->swap_next = t->swap_end = 0;
 #endif
 
   old_level = intr_disable ();
@@ -736,10 +892,22 @@ alloc_frame (struct thread *t, size_t size)
 static struct thread *
 next_thread_to_run (void) 
 {
-  if (list_empty (&ready_list))
-    return idle_thread;
-  else
-    return list_entry (list_pop_front (&ready_list), struct thread, elem);
+  for (;;)
+    {
+      int pri = ready_max_priority ();
+      if (pri < 0)
+        return idle_thread;
+
+      struct thread *t = list_entry (list_front (&ready_queues[pri]), struct thread, elem);
+      if (thread_mlfqs && t->decay_epoch != mlfqs_epoch)
+        {
+          /* Its priority may drop once it is up to date. */
+          mlfqs_catch_up (t);
+          continue;
+        }
+      ready_remove (t);
+      return t;
+    }
 }
 
 /* Completes a thread switch by activating the new thread's page
@@ -805,6 +973,9 @@ schedule (void)
   ASSERT (cur->status != THREAD_RUNNING);
   ASSERT (is_thread (next));
 
+  if (cur == idle_thread)
+    timer_idle_exit ();
+
   if (cur != next)
     prev = switch_threads (cur, next);
   thread_schedule_tail (prev);
@@ -111,13 +111,19 @@ struct thread
     uint8_t *stack;                     /* Saved stack pointer. */
     int priority;                       /* Priority. */
     int visible_priority;               /* Visible priority. */
+    int ready_priority;                 /* Ready queue, if ready. */
     struct lock *waiting_lock;                 /* Lock which the thread is waiting for. */
     struct list locks;                  /* Locks which the thread is holding */
-    int64_t wake_tick;
+    int64_t wake_tick;                  /* Tick to wake up at, if sleeping. */
+    unsigned sleep_seq;                 /* Order of going to sleep. */
+    struct thread *sleep_left;          /* Children in the sleep heap. */
+    struct thread *sleep_right;
+    int sleep_rank;                     /* Length of right spine. */
     struct list_elem allelem;           /* List element for all threads list. */
 
     int nice;
     int recent_cpu;
+    int decay_epoch;                    /* Decays applied to recent_cpu. */
 
     /* Shared between thread.c and synch.c. */
     struct list_elem elem;              /* List element. */
@@ -142,6 +148,8 @@ struct thread
     struct hash *spt;
     void *esp;
     struct list mmap_list;
+    size_t swap_next;                   /* Next slot in swap cluster. */
+    size_t swap_end;                    /* End of swap cluster. */
 #endif
 
     /* Owned by thread.c. */
@@ -161,6 +169,7 @@ void thread_print_stats (void);
 
 void thread_sleep (int64_t);
 void thread_awake (int64_t);
+int64_t thread_next_wake_tick (void);
 
 typedef void thread_func (void *aux);
 tid_t thread_create (const char *name, int priority, thread_func *, void *);
@@ -182,7 +191,7 @@ typedef void thread_action_func (struct thread *t, void *aux);
 void thread_foreach (thread_action_func *, void *);
 
 void thread_compare_and_yield (void);
-void thread_sort_ready_list (void);
+void thread_requeue (struct thread *);
 
 void thread_refresh_visible_priority (void);
 
@@ -195,10 +204,6 @@ int thread_get_recent_cpu (void);
 int thread_get_load_avg (void);
 
 void mlfqs_set_priority (struct thread *t);
-void mlfqs_set_recent_cpu (struct thread *t);
-void mlfqs_set_load_avg (void);
-void mlfqs_up_recent_cpu (void);
-void mlfqs_all_set_priority (void);
-void mlfqs_all_set_recent_cpu (void);
+void mlfqs_tick (int64_t ticks);
 
 #endif /* threads/thread.h */
@@ -152,20 +152,22 @@ page_fault(struct intr_frame *f)
    user = (f->error_code & PF_U) != 0;
 
 
-   if (not_present)
+   /* A write to a present page may be the first write to a page
+      mapped to the shared zero frame. */
+   if (not_present || write)
    {
       struct thread *t = thread_current();
       void *fault_page = pg_round_down(fault_addr);
       void *esp = user ? f->esp : t->esp;
 
-      if (has_entry_in_spt(t->spt, fault_page) && load_page_from_spt(t->spt, fault_page, t->pagedir, false))
+      if (has_entry_in_spt(t->spt, fault_page) && load_page_from_spt(t->spt, fault_page, t->pagedir, write, false))
          return;
       else if(is_stack_access(esp, fault_addr, f))
       {
          if(has_entry_in_spt(t->spt, fault_page) == false)
             install_allzero_entry_in_spt(t->spt, fault_page);
 
-         if(load_page_from_spt(t->spt, fault_page, t->pagedir, false))
+         if(load_page_from_spt(t->spt, fault_page, t->pagedir, write, false))
             return;
          
       }
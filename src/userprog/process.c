@@ -14,6 +14,7 @@
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
+#include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/vaddr.h"
@@ -23,6 +24,7 @@
 #include "vm/page.h"
 
 static thread_func start_process NO_RETURN;
+static thread_func start_fork NO_RETURN;
 static bool load (const char *cmdline, void (**eip) (void), void **esp);
 static void save_arguments_to_stack (char **argv, int argc, void **esp);
 
@@ -147,6 +149,116 @@ start_process (void *task_name_)
   NOT_REACHED ();
 }
 
+/* Creates a child of the current process that is a copy of it,
+   resuming in user mode from interrupt frame F with 0 as the
+   return value of the system call, and waits for the copy to
+   be made.  Pages are shared with the child copy-on-write, so
+   the copy is cheap.  Returns the child's thread id, or
+   TID_ERROR if the child cannot be created. */
+tid_t
+process_fork (const struct intr_frame *f)
+{
+  struct thread *parent = thread_current ();
+  struct intr_frame *if_;
+  tid_t tid;
+
+  /* Make a copy of F for the child, since F lives on our stack
+     and we are not allowed to return until the child is done. */
+  if_ = malloc (sizeof *if_);
+  if (if_ == NULL)
+    return TID_ERROR;
+  *if_ = *f;
+
+  tid = thread_create (parent->name, PRI_DEFAULT, start_fork, if_);
+  if (tid == TID_ERROR)
+    {
+      free (if_);
+      return tid;
+    }
+
+  sema_down (&parent->wait_load);
+  if (parent->success_load == false)
+    return TID_ERROR;
+
+  return tid;
+}
+
+/* Makes a copy of a file descriptor table entry DESC, of the
+   parent process, in the current process.  Returns true if
+   successful. */
+static bool
+fork_file_descriptor (const struct file_descriptor *desc)
+{
+  struct thread *t = thread_current ();
+  struct file_descriptor *copy;
+  struct file *file;
+
+  file = file_reopen (desc->file);
+  if (file == NULL)
+    return false;
+  file_seek (file, file_tell (desc->file));
+
+  copy = palloc_get_page (0);
+  if (copy == NULL)
+    {
+      file_close (file);
+      return false;
+    }
+  copy->id = desc->id;
+  copy->file = file;
+  list_push_back (&t->fd_table, &copy->elem);
+  return true;
+}
+
+/* A thread function that makes the current thread a copy of the
+   process that forked it and starts it running. */
+static void
+start_fork (void *if_)
+{
+  struct thread *child = thread_current ();
+  struct thread *parent = child->parent;
+  struct intr_frame if_copy = *(struct intr_frame *) if_;
+  struct list_elem *e;
+  bool success = false;
+
+  free (if_);
+
+  /* The parent is blocked until we are done, so its address
+     space and files hold still while we copy them. */
+  child->pagedir = pagedir_create ();
+  child->spt = create_spt ();
+  if (child->pagedir == NULL || child->spt == NULL)
+    goto done;
+  process_activate ();
+
+  child->executable = file_reopen (parent->executable);
+  if (child->executable == NULL)
+    goto done;
+  file_deny_write (child->executable);
+
+  if (!fork_spt (parent, child->executable))
+    goto done;
+
+  for (e = list_begin (&parent->fd_table); e != list_end (&parent->fd_table);
+       e = list_next (e))
+    if (!fork_file_descriptor (list_entry (e, struct file_descriptor, elem)))
+      goto done;
+
+  success = true;
+
+ done:
+  parent->success_load = success;
+  sema_up (&parent->wait_load);
+  if (!success)
+    thread_exit ();
+
+  /* Return from the system call in the child, with 0 as its
+     result. */
+  if_copy.eax = 0;
+  asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (&if_copy) : "memory");
+  NOT_REACHED ();
+}
+
 static void save_arguments_to_stack (char **argv, int argc, void **esp) 
 {
   void *args_addr[argc];
@@ -225,7 +337,8 @@ process_exit (void)
               list_entry (list_begin (&cur->mmap_list), struct mmap_descriptor, elem);
       munmap (mmap_desc->id);
     }
-  destroy_spt (cur->spt);
+  if (cur->spt != NULL)
+    destroy_spt (cur->spt);
 #endif
 
   /* Destroy the current process's page directory and switch back
@@ -360,6 +473,8 @@ load (const char *file_name, void (**eip) (void), void **esp)
   t->pagedir = pagedir_create ();
 #ifdef VM
   t->spt = create_spt ();
+  if (t->spt == NULL)
+    goto done;
 #endif
   if (t->pagedir == NULL) 
     goto done;
@@ -31,16 +31,13 @@ static void seek (int fd, unsigned position);
 static unsigned tell (int fd);
 static void close (int fd);
 
-static void load_and_pin_buffer_pages (const void *buffer, unsigned size);
+static void load_and_pin_buffer_pages (const void *buffer, unsigned size, bool write);
 static void unpin_buffer_pages (const void *buffer, unsigned size);
 static int mmap (int fd, void *addr);
 
-static struct lock filesys_lock;
-
 void
 syscall_init (void) 
 {
-  lock_init (&filesys_lock);
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
@@ -162,6 +159,11 @@ syscall_handler (struct intr_frame *f UNUSED)
           munmap (*(int *) (args[0]));
           break;
         }
+      case SYS_FORK:
+        {
+          f->eax = process_fork (f);
+          break;
+        }
       default:
         {
           exit (-1);
@@ -211,10 +213,7 @@ exit (int status)
 static int
 exec (const char *cmd_line)
 {
-  lock_acquire (&filesys_lock);
-  int pid = process_execute(cmd_line);
-  lock_release (&filesys_lock);
-  return pid;
+  return process_execute (cmd_line);
 }
 
 static int
@@ -228,9 +227,7 @@ create (const char *file, unsigned initial_size)
 {
   check_user_address_valid ((void *) file);
 
-  lock_acquire (&filesys_lock);
   bool success = filesys_create (file, initial_size);
-  lock_release (&filesys_lock);
 
   return success;
 }
@@ -240,9 +237,7 @@ remove (const char *file)
 {
   check_user_address_valid ((void *) file);
 
-  lock_acquire (&filesys_lock);
   bool success = filesys_remove (file);
-  lock_release (&filesys_lock);
 
   return success;
 }
@@ -253,13 +248,11 @@ open (const char *file)
   check_user_address_valid ((void *) file);
   int fd = -1;
 
-  lock_acquire (&filesys_lock);
   struct file* opened_file = filesys_open (file);
   if (opened_file != NULL)
     {
       fd = create_file_descriptor (opened_file);
     }
-  lock_release (&filesys_lock);
   return fd;
 }
 
@@ -269,9 +262,7 @@ filesize (int fd)
   struct file *file = get_file (fd);
   if (file == NULL)
     return -1;
-  lock_acquire (&filesys_lock);
   int size = file_length (file);
-  lock_release (&filesys_lock);
   return size;
 }
 
@@ -290,17 +281,12 @@ read (int fd, void *buffer, unsigned size)
     }
   else
     {
-      lock_acquire (&filesys_lock);
       struct file *file = get_file (fd);
       if (file == NULL)
-        {
-          lock_release (&filesys_lock);
-          return -1;
-        }
-      load_and_pin_buffer_pages (buffer, size);
+        return -1;
+      load_and_pin_buffer_pages (buffer, size, true);
       int bytes_read = file_read (file, buffer, size);
       unpin_buffer_pages (buffer, size);
-      lock_release (&filesys_lock);
       return bytes_read;
     }
 }
@@ -319,17 +305,12 @@ write (int fd, const void *buffer, unsigned size)
     }
   else
     {
-      lock_acquire (&filesys_lock);
       struct file *file = get_file (fd);
       if (file == NULL)
-        {
-          lock_release (&filesys_lock);
-          return -1;
-        }
-      load_and_pin_buffer_pages (buffer, size);
+        return -1;
+      load_and_pin_buffer_pages (buffer, size, false);
       int bytes_written = file_write (file, buffer, size);
       unpin_buffer_pages (buffer, size);
-      lock_release (&filesys_lock);
       return bytes_written;
     }
 }
@@ -337,38 +318,26 @@ write (int fd, const void *buffer, unsigned size)
 static void
 seek (int fd, unsigned position)
 {
-  lock_acquire (&filesys_lock);
   struct file *file = get_file (fd);
   if (file == NULL)
-    {
-      lock_release (&filesys_lock);
-      exit (-1);
-    }
+    exit (-1);
   file_seek (file, position);
-  lock_release (&filesys_lock);
 }
 
 static unsigned
 tell (int fd)
 {
-  lock_acquire (&filesys_lock);
   struct file *file = get_file (fd);
   if (file == NULL)
-    {
-      lock_release (&filesys_lock);
-      exit (-1);
-    }
+    exit (-1);
   int position = file_tell (file);
-  lock_release (&filesys_lock);
   return position;
 }
 
 static void
 close (int fd)
 {
-  lock_acquire (&filesys_lock);
   remove_file (fd);
-  lock_release (&filesys_lock);
 }
 
 static int
@@ -379,37 +348,24 @@ mmap (int fd, void *addr)
   if (addr == NULL || pg_ofs (addr) != 0)
     return -1;
 
-  lock_acquire (&filesys_lock);
   struct file *found_file = get_file (fd);
   if (found_file == NULL)
-    {
-      lock_release (&filesys_lock);
-      return -1;
-    }
+    return -1;
 
   struct file *new_file = file_reopen (found_file);
   if (new_file == NULL)
-    {
-      lock_release (&filesys_lock);
-      return -1;
-    }
+    return -1;
 
   int file_size = file_length (new_file);
   if (file_size == 0)
-    {
-      lock_release (&filesys_lock);
-      return -1;
-    }
+    return -1;
 
   struct thread *t = thread_current ();
   int i;
   for (i = 0; i < file_size; i += PGSIZE)
     {
       if (has_entry_in_spt (t->spt, addr + i))
-        {
-          lock_release (&filesys_lock);
-          return -1;
-        }
+        return -1;
     }
 
   for (i = 0; i < file_size; i += PGSIZE)
@@ -434,7 +390,6 @@ mmap (int fd, void *addr)
   mmap_desc->addr = addr;
   list_push_back (&t->mmap_list, &mmap_desc->elem);
 
-  lock_release (&filesys_lock);
   return mmap_desc->id;
 }
 
@@ -463,7 +418,6 @@ munmap (int mapid)
     return;
 
   struct thread *t = thread_current ();
-  lock_acquire (&filesys_lock);
   int i;
   for (i = 0; i < mmap_desc->size; i += PGSIZE)
     {
@@ -473,17 +427,18 @@ munmap (int mapid)
   list_remove (&mmap_desc->elem);
   file_close (mmap_desc->file);
   free (mmap_desc);
-  lock_release (&filesys_lock);
 }
 
+/* Loads and pins the user pages spanned by BUFFER, making them
+   writable if the kernel is about to WRITE into BUFFER. */
 static void
-load_and_pin_buffer_pages (const void *buffer, unsigned size)
+load_and_pin_buffer_pages (const void *buffer, unsigned size, bool write)
 {
   struct thread *t = thread_current ();
   void *upage;
   for (upage = pg_round_down (buffer); upage < buffer + size; upage += PGSIZE)
     {
-      load_page_from_spt (t->spt, upage, t->pagedir, true);
+      load_page_from_spt (t->spt, upage, t->pagedir, write, true);
     }
 }
 
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <string.h>
 #include <hash.h>
+#include <round.h>
 #include "threads/thread.h"
 #include "threads/synch.h"
 #include "threads/palloc.h"
@@ -10,140 +12,1059 @@
 #include "vm/page.h"
 #include "vm/swap.h"
 
+/* The frame table has one entry for each page in the user pool,
+   which is contiguous, so the entry for a frame is found by
+   indexing rather than by lookup.  An entry whose KPAGE is null
+   is not in use. */
 static struct lock frame_table_lock;
-static struct hash frame_table;
+static struct frame_table_entry *frame_table;
+static uint8_t *user_base;              /* First page of the user pool. */
+static size_t user_page_cnt;            /* Pages in the user pool. */
+
+/* Eviction uses WSClock.  Every frame is on FRAME_RING, and the
+   clock hand, CLOCK_HAND, sweeps around it from one eviction to
+   the next.  Frames accessed since the hand last passed get a
+   second chance.  Of the rest, the hand stops at the first that
+   can be evicted without a write.  Dirty frames it passes over
+   are queued on CLEAN_QUEUE, for the cleaner thread to write
+   back in the background, so that they are clean by the time
+   the hand comes around again.  Only if a whole sweep finds
+   nothing clean does eviction write a page itself, and then it
+   releases FRAME_TABLE_LOCK for the write, as the cleaner does,
+   so that other faults do not wait for it.
+
+   The cleaner thread also keeps the user pool from running dry.
+   When an allocation leaves fewer than FREE_LOW_WATER frames
+   free, it evicts clean frames ahead of need until
+   FREE_HIGH_WATER frames are free, so that a page fault rarely
+   has to evict anything itself. */
+static struct list frame_ring;
+static struct list_elem *clock_hand;
+static size_t frame_cnt;                /* Frames on FRAME_RING. */
+static struct list clean_queue;
+static struct condition cleaner_wakeup;
+static struct condition write_back_done; /* Signaled when a write-back ends. */
+static size_t write_back_cnt;           /* Write-backs in progress. */
+static unsigned frame_seq;              /* Stamps each new frame. */
+static size_t free_low_water;
+static size_t free_high_water;
+
+/* Statistics. */
+static long long evict_cnt;             /* Evictions on page faults. */
+static long long preevict_cnt;          /* Evictions ahead of need. */
+static long long scan_cnt;              /* Frames examined to evict. */
+static long long dirty_evict_cnt;       /* Evictions that wrote a page. */
+static long long clean_cnt;             /* Pages written back ahead. */
+
+/* A page that eviction writes out with FRAME_TABLE_LOCK
+   released; see evict_frame(). */
+struct page_write
+  {
+    struct thread *owner;
+    struct supplemental_page_table_entry *spte;
+    void *kpage;
+  };
+
+/* Shared read-only file frames, indexed by inode and offset. */
+static struct hash shared_frames;
+
+/* A page of zeros, mapped read-only into every process in place
+   of ALL_ZERO pages that are read before they are written. */
+static void *zero_frame;
 
 static void internal_free_frame_with_lock_held (void *kpage, bool should_free_page);
+static struct frame_table_entry *find_frame (void *kpage);
+static void evict_frame (struct frame_table_entry *victim);
+static void wait_for_eviction_with_lock_held (struct supplemental_page_table_entry *spte);
+static thread_func cleaner_thread NO_RETURN;
 
-static unsigned frame_hash_func(const struct hash_elem *h_elem, void *aux UNUSED)
+static unsigned
+shared_hash_func (const struct hash_elem *h_elem, void *aux UNUSED)
 {
-  struct frame_table_entry *entry = hash_entry (h_elem, struct frame_table_entry, elem);
-  return hash_bytes (&entry->kpage, sizeof entry->kpage);
+  struct frame_table_entry *entry = hash_entry (h_elem, struct frame_table_entry, shared_elem);
+  return hash_bytes (&entry->inode, sizeof entry->inode) ^ hash_int (entry->offset);
 }
-static bool frame_less_func(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+static bool
+shared_less_func (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
 {
-  struct frame_table_entry *a_entry = hash_entry (a, struct frame_table_entry, elem);
-  struct frame_table_entry *b_entry = hash_entry (b, struct frame_table_entry, elem);
-  return a_entry->kpage < b_entry->kpage;
+  struct frame_table_entry *a_entry = hash_entry (a, struct frame_table_entry, shared_elem);
+  struct frame_table_entry *b_entry = hash_entry (b, struct frame_table_entry, shared_elem);
+  if (a_entry->inode != b_entry->inode)
+    return a_entry->inode < b_entry->inode;
+  return a_entry->offset < b_entry->offset;
 }
 
 void
 frame_init (void)
 {
   lock_init (&frame_table_lock);
-  hash_init (&frame_table, frame_hash_func, frame_less_func, NULL);
+  user_base = palloc_user_pool (&user_page_cnt);
+  frame_table = palloc_get_multiple (PAL_ASSERT | PAL_ZERO,
+                                     DIV_ROUND_UP (user_page_cnt * sizeof *frame_table,
+                                                   PGSIZE));
+  hash_init (&shared_frames, shared_hash_func, shared_less_func, NULL);
+  zero_frame = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+
+  list_init (&frame_ring);
+  clock_hand = list_end (&frame_ring);
+  frame_cnt = 0;
+  list_init (&clean_queue);
+  cond_init (&cleaner_wakeup);
+  cond_init (&write_back_done);
+  free_low_water = palloc_free_cnt (PAL_USER) / 32 + 1;
+  free_high_water = 2 * free_low_water;
+  thread_create ("cleaner", PRI_DEFAULT, cleaner_thread, NULL);
 }
 
+/* Returns the frame table entry for user pool page KPAGE,
+   whether or not it is in use. */
 static struct frame_table_entry *
-select_victim_for_eviction ()
+frame_entry (void *kpage)
+{
+  size_t idx = ((uint8_t *) kpage - user_base) / PGSIZE;
+
+  ASSERT (pg_ofs (kpage) == 0);
+  ASSERT ((uint8_t *) kpage >= user_base && idx < user_page_cnt);
+  return &frame_table[idx];
+}
+
+/* Returns the shared zero frame.  It is not in the frame table,
+   so it is never evicted, and must never be written. */
+void *
+get_zero_frame (void)
+{
+  return zero_frame;
+}
+
+/* Returns true if any process that maps ENTRY has accessed it
+   since the last call, clearing the accessed bits. */
+static bool
+frame_test_and_clear_accessed (struct frame_table_entry *entry)
 {
-  struct hash_iterator iter;
-  hash_first (&iter, &frame_table);
+  bool accessed = false;
+  struct list_elem *e;
 
-  while (hash_next (&iter))
+  if (pagedir_is_accessed (entry->owner->pagedir, entry->upage))
+    {
+      pagedir_set_accessed (entry->owner->pagedir, entry->upage, false);
+      accessed = true;
+    }
+  for (e = list_begin (&entry->sharers); e != list_end (&entry->sharers);
+       e = list_next (e))
+    {
+      struct frame_sharer *s = list_entry (e, struct frame_sharer, elem);
+      if (pagedir_is_accessed (s->owner->pagedir, s->upage))
+        {
+          pagedir_set_accessed (s->owner->pagedir, s->upage, false);
+          accessed = true;
+        }
+    }
+  return accessed;
+}
+
+/* Unmaps read-only file frame ENTRY from every process other
+   than its OWNER, leaving their pages to be read from the file
+   again. */
+static void
+unmap_sharers (struct frame_table_entry *entry)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&entry->sharers); e != list_end (&entry->sharers);
+       e = list_next (e))
+    {
+      struct frame_sharer *s = list_entry (e, struct frame_sharer, elem);
+      struct supplemental_page_table_entry *spte = get_entry_in_spt (s->owner->spt, s->upage);
+      ASSERT (spte != NULL);
+      spte->kpage = NULL;
+      spte->state = ON_FILESYS;
+      pagedir_clear_page (s->owner->pagedir, s->upage);
+    }
+}
+
+/* Returns true if evicting the page described by SPTE means
+   writing it to swap. */
+static bool
+evicts_to_swap (struct supplemental_page_table_entry *spte)
+{
+  return spte->file == NULL || (!spte->from_mapped_file && spte->writable);
+}
+
+/* Returns true if the swap copy of the page at UPAGE in OWNER,
+   described by SPTE, is still current, so that evicting the
+   page needs no write. */
+static bool
+swap_copy_current (struct thread *owner, void *upage,
+                   struct supplemental_page_table_entry *spte)
+{
+  return spte->swap_valid && !pagedir_is_dirty (owner->pagedir, upage);
+}
+
+/* Returns true if ENTRY's page can be evicted without writing
+   it anywhere. */
+static bool
+frame_is_clean (struct frame_table_entry *entry)
+{
+  struct supplemental_page_table_entry *spte = get_entry_in_spt (entry->owner->spt, entry->upage);
+
+  if (!list_empty (&entry->sharers))
+    return entry->inode != NULL;
+  if (spte->file != NULL && spte->from_mapped_file)
+    return !spte->writable || !pagedir_is_dirty (entry->owner->pagedir, entry->upage);
+  if (evicts_to_swap (spte))
+    return swap_copy_current (entry->owner, entry->upage, spte);
+  return true;
+}
+
+/* Queues ENTRY's page to be written back by the cleaner thread,
+   if it is not queued already. */
+static void
+queue_for_cleaning (struct frame_table_entry *entry)
+{
+  if (!entry->clean_queued && !entry->cleaning)
     {
-      struct frame_table_entry *entry = hash_entry (hash_cur (&iter), struct frame_table_entry, elem);
-      if (entry->pinned)
+      entry->clean_queued = true;
+      list_push_back (&clean_queue, &entry->clean_elem);
+      cond_signal (&cleaner_wakeup, &frame_table_lock);
+    }
+}
+
+/* Moves the clock hand to the next frame on the ring, wrapping
+   around at the end, and returns that frame. */
+static struct frame_table_entry *
+advance_clock_hand (void)
+{
+  ASSERT (!list_empty (&frame_ring));
+
+  if (clock_hand == list_end (&frame_ring))
+    clock_hand = list_begin (&frame_ring);
+  struct frame_table_entry *entry = list_entry (clock_hand, struct frame_table_entry, ring_elem);
+  clock_hand = list_next (clock_hand);
+  return entry;
+}
+
+/* Chooses a frame to evict by sweeping the clock hand, as
+   described at the top of this file.  The first sweep may only
+   clear accessed bits, so the hand may go around twice.  If no
+   clean frame turns up, returns a dirty one if MAY_WRITE is
+   true.  Returns a null pointer if there is no frame to
+   return, for example because every frame is pinned or being
+   written back. */
+static struct frame_table_entry *
+select_victim_for_eviction (bool may_write)
+{
+  struct frame_table_entry *dirty_victim = NULL;
+  size_t i;
+
+  for (i = 0; i < 2 * frame_cnt; i++)
+    {
+      struct frame_table_entry *entry = advance_clock_hand ();
+
+      scan_cnt++;
+      if (entry->pin_cnt > 0 || entry->cleaning)
         continue;
-      if (pagedir_is_accessed (entry->owner->pagedir, entry->upage))
-        pagedir_set_accessed (entry->owner->pagedir, entry->upage, false);
-      else
+      if (frame_test_and_clear_accessed (entry))
+        continue;
+      if (frame_is_clean (entry))
         return entry;
+
+      queue_for_cleaning (entry);
+      if (dirty_victim == NULL)
+        dirty_victim = entry;
     }
 
-  hash_first (&iter, &frame_table);
+  if (!may_write || dirty_victim == NULL)
+    return NULL;
+  dirty_evict_cnt++;
+  return dirty_victim;
+}
 
-  while (hash_next (&iter))
+/* Evicts clean frames until FREE_HIGH_WATER frames are free, or
+   until no clean frame is left.  FRAME_TABLE_LOCK must be
+   held.  Clean frames need no write, so it is held
+   throughout. */
+static void
+reclaim_frames (void)
+{
+  while (palloc_free_cnt (PAL_USER) < free_high_water)
     {
-      struct frame_table_entry *entry = hash_entry(hash_cur (&iter), struct frame_table_entry, elem);
-      if (entry->pinned)
-        continue;
-      if (pagedir_is_accessed (entry->owner->pagedir, entry->upage))
-        pagedir_set_accessed (entry->owner->pagedir, entry->upage, false);
+      struct frame_table_entry *victim = select_victim_for_eviction (false);
+      if (victim == NULL)
+        break;
+      evict_frame (victim);
+      preevict_cnt++;
+    }
+}
+
+/* Keeps frames free, with reclaim_frames(), and writes back the
+   pages queued on CLEAN_QUEUE, one at a time.  Each page is
+   copied into a buffer and its dirty bit cleared with
+   FRAME_TABLE_LOCK held, then written from the buffer without
+   it, so that faults are not held up by the write.  The frame
+   stays marked as being cleaned until the write completes.  If a
+   page bound for swap was dirtied or freed in the meantime, the
+   copy just written is stale and is thrown away.  A write to a
+   mapped file cannot be undone that way, so unmapping the page
+   waits for it to finish instead; see wait_for_write_back(). */
+static void
+cleaner_thread (void *aux UNUSED)
+{
+  void *buffer = palloc_get_page (PAL_ASSERT);
+
+  for (;;)
+    {
+      struct frame_table_entry *entry;
+      struct supplemental_page_table_entry *spte;
+      struct file *file = NULL;
+      off_t offset = 0;
+      size_t bytes = 0;
+      size_t slot;
+
+      lock_acquire (&frame_table_lock);
+      for (;;)
+        {
+          if (palloc_free_cnt (PAL_USER) < free_low_water)
+            reclaim_frames ();
+          if (!list_empty (&clean_queue))
+            break;
+          cond_wait (&cleaner_wakeup, &frame_table_lock);
+        }
+      entry = list_entry (list_pop_front (&clean_queue), struct frame_table_entry, clean_elem);
+      entry->clean_queued = false;
+      if (entry->pin_cnt > 0 || entry->cleaning || !list_empty (&entry->sharers)
+          || frame_is_clean (entry))
+        {
+          lock_release (&frame_table_lock);
+          continue;
+        }
+
+      struct thread *owner = entry->owner;
+      void *kpage = entry->kpage;
+      void *upage = entry->upage;
+      unsigned seq = entry->seq;
+
+      spte = get_entry_in_spt (owner->spt, upage);
+      memcpy (buffer, kpage, PGSIZE);
+      pagedir_set_dirty (owner->pagedir, upage, false);
+      entry->cleaning = true;
+      write_back_cnt++;
+      if (spte->file != NULL && spte->from_mapped_file)
+        {
+          file = file_reopen (spte->file);
+          offset = spte->file_offset;
+          bytes = spte->file_read_bytes;
+        }
+      else if (spte->swap_valid)
+        {
+          swap_free (spte->swap_index);
+          spte->swap_valid = false;
+        }
+      lock_release (&frame_table_lock);
+
+      if (file != NULL)
+        {
+          file_write_at (file, buffer, bytes, offset);
+          file_close (file);
+        }
       else
-        return entry;
+        swap_out (owner, &buffer, 1, &slot);
+
+      lock_acquire (&frame_table_lock);
+      entry = find_frame (kpage);
+      if (entry != NULL && entry->seq == seq)
+        {
+          entry->cleaning = false;
+          clean_cnt++;
+        }
+      write_back_cnt--;
+      cond_broadcast (&write_back_done, &frame_table_lock);
+      if (file == NULL)
+        {
+          if (entry != NULL && entry->seq == seq
+              && entry->owner == owner && entry->upage == upage
+              && !pagedir_is_dirty (owner->pagedir, upage))
+            {
+              spte->swap_index = slot;
+              spte->swap_valid = true;
+            }
+          else
+            swap_free (slot);
+        }
+      lock_release (&frame_table_lock);
     }
+}
 
-  PANIC("No victim for eviction");
+/* Returns true if every byte of frame KPAGE is zero. */
+static bool
+frame_is_zero (const void *kpage)
+{
+  const uint32_t *p = kpage;
+  size_t i;
+
+  for (i = 0; i < PGSIZE / sizeof *p; i++)
+    if (p[i] != 0)
+      return false;
+  return true;
 }
 
-void *
-allocate_frame (enum palloc_flags flags, void *upage)
+/* Returns true if the page at UPAGE in OWNER is still on frame
+   ENTRY, or on its way out of it. */
+static bool
+still_maps (struct frame_table_entry *entry, struct thread *owner, void *upage)
 {
-  ASSERT (is_user_vaddr (upage));
+  struct supplemental_page_table_entry *spte = get_entry_in_spt (owner->spt, upage);
+  return (spte != NULL && spte->kpage == entry->kpage
+          && (spte->state == ON_FRAME || spte->state == EVICTING));
+}
+
+/* Drops the mappings of frame ENTRY whose pages have left it,
+   handing ownership to a remaining sharer if need be, and frees
+   the frame once no mapping is left.  FRAME_TABLE_LOCK must be
+   held. */
+static void
+drop_evicted_mappings (struct frame_table_entry *entry)
+{
+  struct list_elem *e, *next;
+
+  for (e = list_begin (&entry->sharers); e != list_end (&entry->sharers); e = next)
+    {
+      struct frame_sharer *s = list_entry (e, struct frame_sharer, elem);
+      next = list_next (e);
+      if (!still_maps (entry, s->owner, s->upage))
+        {
+          list_remove (&s->elem);
+          free (s);
+        }
+    }
+
+  if (!still_maps (entry, entry->owner, entry->upage))
+    {
+      if (list_empty (&entry->sharers))
+        internal_free_frame_with_lock_held (entry->kpage, true);
+      else
+        {
+          struct frame_sharer *s = list_entry (list_pop_front (&entry->sharers),
+                                               struct frame_sharer, elem);
+          entry->owner = s->owner;
+          entry->upage = s->upage;
+          free (s);
+        }
+    }
+}
+
+/* Unmaps the page at UPAGE in OWNER, on frame KPAGE, to evict it
+   to swap.  If swap already holds a current copy of the page, or
+   the page is all zeros, it is evicted at once.  Otherwise it is
+   marked EVICTING and added to WRITES, incrementing *WRITE_CNT,
+   for the caller to write out. */
+static void
+unmap_for_swap (void *kpage, struct thread *owner, void *upage,
+                struct page_write writes[], size_t *write_cnt)
+{
+  struct supplemental_page_table_entry *spte = get_entry_in_spt (owner->spt, upage);
+
+  /* Unmap the page before checking whether it is dirty, so that
+     it cannot be written in between. */
+  pagedir_clear_page (owner->pagedir, upage);
+  if (swap_copy_current (owner, upage, spte))
+    {
+      spte->kpage = NULL;
+      spte->state = SWAPPED_OUT;
+      return;
+    }
+
+  if (spte->swap_valid)
+    {
+      /* Stale copy: the page was modified since swap-in. */
+      swap_free (spte->swap_index);
+      spte->swap_valid = false;
+    }
+  if (frame_is_zero (kpage))
+    {
+      spte->kpage = NULL;
+      spte->state = ALL_ZERO;
+      return;
+    }
+  spte->state = EVICTING;
+  writes[*write_cnt].owner = owner;
+  writes[*write_cnt].spte = spte;
+  writes[*write_cnt].kpage = kpage;
+  (*write_cnt)++;
+}
+
+/* Unmaps copy-on-write frame VICTIM, which several processes
+   map, to evict it to swap.  Swap slots are not shared, so each
+   process gets a copy of its own.  At most SWAP_BATCH_PAGES
+   copies are written at a time; processes beyond that keep the
+   frame mapped for now.  Returns the number of pages stored in
+   WRITES for the caller to write out. */
+static size_t
+unmap_cow_for_swap (struct frame_table_entry *victim, struct page_write writes[])
+{
+  size_t write_cnt = 0;
+  struct list_elem *e;
+
+  unmap_for_swap (victim->kpage, victim->owner, victim->upage, writes, &write_cnt);
+  for (e = list_begin (&victim->sharers);
+       e != list_end (&victim->sharers) && write_cnt < SWAP_BATCH_PAGES;
+       e = list_next (e))
+    {
+      struct frame_sharer *s = list_entry (e, struct frame_sharer, elem);
+      unmap_for_swap (victim->kpage, s->owner, s->upage, writes, &write_cnt);
+    }
+  return write_cnt;
+}
+
+/* Unmaps VICTIM's page to evict it to swap.  Unless swap
+   already holds a current copy of the page, up to
+   SWAP_BATCH_PAGES - 1 other unpinned, recently unused pages of
+   the same process that would also need writing to swap are
+   unmapped along with it, so the whole batch is written in one
+   request.  The batch is ordered by user address, so that pages
+   next to each other in the address space end up next to each
+   other in swap too.  Returns the number of pages stored in
+   WRITES for the caller to write out. */
+static size_t
+unmap_batch_for_swap (struct frame_table_entry *victim, struct page_write writes[])
+{
+  struct thread *owner = victim->owner;
+  struct frame_table_entry *batch[SWAP_BATCH_PAGES];
+  size_t write_cnt = 0;
+  size_t cnt = 0;
+  size_t idx, i;
+
+  if (!list_empty (&victim->sharers))
+    return unmap_cow_for_swap (victim, writes);
+
+  batch[cnt++] = victim;
+  struct supplemental_page_table_entry *victim_spte = get_entry_in_spt (owner->spt, victim->upage);
+  if (!swap_copy_current (owner, victim->upage, victim_spte))
+    for (idx = 0; cnt < SWAP_BATCH_PAGES && idx < user_page_cnt; idx++)
+      {
+        struct frame_table_entry *entry = &frame_table[idx];
+        if (entry->kpage == NULL || entry == victim || entry->owner != owner
+            || entry->pin_cnt > 0 || entry->cleaning || !list_empty (&entry->sharers)
+            || pagedir_is_accessed (owner->pagedir, entry->upage))
+          continue;
+
+        struct supplemental_page_table_entry *spte = get_entry_in_spt (owner->spt, entry->upage);
+        if (spte != NULL && evicts_to_swap (spte)
+            && !swap_copy_current (owner, entry->upage, spte))
+          {
+            /* Insertion sort by user address. */
+            for (i = cnt; i > 0 && batch[i - 1]->upage > entry->upage; i--)
+              batch[i] = batch[i - 1];
+            batch[i] = entry;
+            cnt++;
+          }
+      }
+
+  for (i = 0; i < cnt; i++)
+    unmap_for_swap (batch[i]->kpage, owner, batch[i]->upage, writes, &write_cnt);
+  for (i = 0; i < cnt; i++)
+    if (batch[i] != victim)
+      drop_evicted_mappings (batch[i]);
+  return write_cnt;
+}
+
+/* Writes out the CNT pages in WRITES, unmapped and marked
+   EVICTING by the caller, with FRAME_TABLE_LOCK released, then
+   finishes evicting them and frees the frames they leave
+   behind. */
+static void
+write_evicted_pages (struct page_write writes[], size_t cnt)
+{
+  size_t slots[SWAP_BATCH_PAGES];
+  void *pages[SWAP_BATCH_PAGES];
+  size_t i, j;
+
+  /* Keep the frames off the clock and away from the cleaner
+     until the writes are done.  The owners of the pages wait for
+     them to be done before touching the pages again; see
+     wait_for_eviction(). */
+  for (i = 0; i < cnt; i++)
+    find_frame (writes[i].kpage)->cleaning = true;
+  write_back_cnt++;
+  lock_release (&frame_table_lock);
+
+  for (i = 0; i < cnt; i = j)
+    {
+      struct supplemental_page_table_entry *spte = writes[i].spte;
+
+      if (spte->from_mapped_file)
+        {
+          file_write_at (spte->file, writes[i].kpage, spte->file_read_bytes,
+                         spte->file_offset);
+          j = i + 1;
+          continue;
+        }
+
+      /* Write each run of pages of one process in one request. */
+      for (j = i; j < cnt && writes[j].owner == writes[i].owner
+                  && !writes[j].spte->from_mapped_file; j++)
+        pages[j - i] = writes[j].kpage;
+      swap_out (writes[i].owner, pages, j - i, slots + i);
+    }
 
   lock_acquire (&frame_table_lock);
+  for (i = 0; i < cnt; i++)
+    {
+      struct supplemental_page_table_entry *spte = writes[i].spte;
 
-  void *kpage = palloc_get_page (flags);
-  if (kpage == NULL)
+      spte->kpage = NULL;
+      if (spte->from_mapped_file)
+        spte->state = ON_FILESYS;
+      else
+        {
+          spte->state = SWAPPED_OUT;
+          spte->swap_index = slots[i];
+          spte->swap_valid = true;
+        }
+    }
+  for (i = 0; i < cnt; i++)
     {
-      struct frame_table_entry *victim_frame = select_victim_for_eviction ();
-      ASSERT (victim_frame != NULL);
-      struct supplemental_page_table_entry *spte = get_entry_in_spt(victim_frame->owner->spt, victim_frame->upage);
-      ASSERT (spte != NULL);
+      struct frame_table_entry *entry = find_frame (writes[i].kpage);
+      if (entry != NULL && entry->cleaning)
+        {
+          entry->cleaning = false;
+          drop_evicted_mappings (entry);
+        }
+    }
+  write_back_cnt--;
+  cond_broadcast (&write_back_done, &frame_table_lock);
+}
 
-      if (spte->file != NULL && spte->from_mapped_file)
+/* Evicts VICTIM's page, along with any others evicted with it,
+   and frees the frames they leave.  FRAME_TABLE_LOCK must be
+   held.  If pages must be written out, the lock is released
+   while they are, so that faults in other processes do not wait
+   for the write; the caller must not assume that anything it
+   saw before the call still holds. */
+static void
+evict_frame (struct frame_table_entry *victim)
+{
+  struct supplemental_page_table_entry *spte = get_entry_in_spt (victim->owner->spt, victim->upage);
+  struct page_write writes[SWAP_BATCH_PAGES];
+  size_t write_cnt = 0;
+
+  ASSERT (spte != NULL);
+
+  if (spte->file != NULL && spte->from_mapped_file)
+    {
+      // NO SWAP - frame from memory mapped file
+      pagedir_clear_page (victim->owner->pagedir, victim->upage);
+      if (pagedir_is_dirty (victim->owner->pagedir, victim->upage) && spte->writable)
         {
-          // NO SWAP - frame from memory mapped file
-          if (pagedir_is_dirty (victim_frame->owner->pagedir, victim_frame->upage) && spte->writable)
-            file_write_at (spte->file, victim_frame->kpage, spte->file_read_bytes, spte->file_offset);
-          spte->kpage = NULL;
-          spte->state = ON_FILESYS;
+          spte->state = EVICTING;
+          writes[0].owner = victim->owner;
+          writes[0].spte = spte;
+          writes[0].kpage = victim->kpage;
+          write_cnt = 1;
         }
-      else if (spte->file != NULL && !spte->writable)
+      else
         {
-          // NO SWAP - frame from readonly executable file
           spte->kpage = NULL;
           spte->state = ON_FILESYS;
         }
-      else
+    }
+  else if (spte->file != NULL && !spte->writable)
+    {
+      // NO SWAP - frame from readonly executable file
+      pagedir_clear_page (victim->owner->pagedir, victim->upage);
+      spte->kpage = NULL;
+      spte->state = ON_FILESYS;
+      unmap_sharers (victim);
+    }
+  else
+    {
+      // SWAP
+      write_cnt = unmap_batch_for_swap (victim, writes);
+    }
+
+  drop_evicted_mappings (victim);
+  if (write_cnt > 0)
+    write_evicted_pages (writes, write_cnt);
+}
+
+/* Allocates a frame for user page UPAGE from the user pool.
+   If the pool is empty, evicts a page to make room if EVICT is
+   true, or returns a null pointer otherwise. */
+static void *
+get_frame (enum palloc_flags flags, void *upage, bool evict)
+{
+  ASSERT (is_user_vaddr (upage));
+
+  lock_acquire (&frame_table_lock);
+
+  void *kpage = palloc_get_page (flags);
+  if (palloc_free_cnt (PAL_USER) < free_low_water)
+    cond_signal (&cleaner_wakeup, &frame_table_lock);
+  if (kpage == NULL && !evict)
+    {
+      lock_release (&frame_table_lock);
+      return NULL;
+    }
+  while (kpage == NULL)
+    {
+      struct frame_table_entry *victim = select_victim_for_eviction (true);
+      if (victim != NULL)
         {
-          // SWAP
-          size_t swap_index = swap_out (victim_frame->kpage);
-          spte->kpage = NULL;
-          spte->state = SWAPPED_OUT;
-          spte->swap_index = swap_index;
+          evict_frame (victim);
+          evict_cnt++;
         }
-      pagedir_clear_page (victim_frame->owner->pagedir, victim_frame->upage);
-      internal_free_frame_with_lock_held (victim_frame->kpage, true);
+      else if (write_back_cnt > 0)
+        {
+          /* Every frame is pinned or being written back.  Wait
+             for a write to finish. */
+          cond_wait (&write_back_done, &frame_table_lock);
+        }
+      else
+        PANIC ("No victim for eviction");
 
+      /* The lock may have been released, so another thread may
+         have taken the frame just freed. */
       kpage = palloc_get_page (flags);
-      ASSERT (kpage != NULL);
     }
 
-  struct frame_table_entry *entry = malloc (sizeof (struct frame_table_entry));
+  struct frame_table_entry *entry = frame_entry (kpage);
   entry->kpage = kpage;
   entry->upage = upage;
   entry->owner = thread_current ();
-  entry->pinned = true;
+  entry->pin_cnt = 1;
+  entry->cow = false;
+  entry->inode = NULL;
+  list_init (&entry->sharers);
+  entry->seq = frame_seq++;
+  entry->clean_queued = false;
+  entry->cleaning = false;
 
-  hash_insert (&frame_table, &entry->elem);
+  /* Insert just behind the clock hand, so the new frame is the
+     last the hand reaches. */
+  list_insert (clock_hand, &entry->ring_elem);
+  frame_cnt++;
 
   lock_release (&frame_table_lock);
   return kpage;
 }
 
+void *
+allocate_frame (enum palloc_flags flags, void *upage)
+{
+  return get_frame (flags, upage, true);
+}
+
+/* Like allocate_frame(), but returns a null pointer instead of
+   evicting a page if no frame is free. */
+void *
+try_allocate_frame (enum palloc_flags flags, void *upage)
+{
+  return get_frame (flags, upage, false);
+}
+
 static void
 internal_free_frame_with_lock_held (void *kpage, bool should_free_page)
 {
   ASSERT (is_kernel_vaddr (kpage));
 
-  struct frame_table_entry entry_for_find;
-  entry_for_find.kpage = kpage;
-
-  struct hash_elem *h_elem = hash_find (&frame_table, &entry_for_find.elem);
-  if (h_elem != NULL)
+  struct frame_table_entry *entry = find_frame (kpage);
+  if (entry != NULL)
     {
-      struct frame_table_entry *entry;
-      entry = hash_entry (h_elem, struct frame_table_entry, elem);
-      hash_delete (&frame_table, &entry->elem);
+      if (clock_hand == &entry->ring_elem)
+        clock_hand = list_next (clock_hand);
+      list_remove (&entry->ring_elem);
+      frame_cnt--;
+      if (entry->clean_queued)
+        list_remove (&entry->clean_elem);
+
+      if (entry->inode != NULL)
+        hash_delete (&shared_frames, &entry->shared_elem);
+      while (!list_empty (&entry->sharers))
+        free (list_entry (list_pop_front (&entry->sharers),
+                          struct frame_sharer, elem));
 
+      entry->kpage = NULL;
       if (should_free_page)
         palloc_free_page (kpage);
-      free (entry);
     }
 }
 
+/* Returns the frame table entry for KPAGE, or a null pointer if
+   there is none.  FRAME_TABLE_LOCK must be held. */
+static struct frame_table_entry *
+find_frame (void *kpage)
+{
+  struct frame_table_entry *entry = frame_entry (kpage);
+  return entry->kpage != NULL ? entry : NULL;
+}
+
+/* Adds the current process's mapping at UPAGE to shared frame
+   ENTRY.  FRAME_TABLE_LOCK must be held.  Returns the frame, or
+   a null pointer if memory is short. */
+static void *
+add_sharer (struct frame_table_entry *entry, void *upage)
+{
+  struct frame_sharer *s = malloc (sizeof (struct frame_sharer));
+  if (s == NULL)
+    return NULL;
+  s->owner = thread_current ();
+  s->upage = upage;
+  list_push_back (&entry->sharers, &s->elem);
+  return entry->kpage;
+}
+
+/* Looks for a frame that already holds the page at OFFSET in
+   INODE's file.  If there is one, records that the current
+   process maps it at UPAGE, pins it, and returns it.  Otherwise
+   returns a null pointer. */
+void *
+find_shared_frame (struct inode *inode, off_t offset, void *upage)
+{
+  struct frame_table_entry key;
+  struct hash_elem *h_elem;
+  void *kpage = NULL;
+
+  key.inode = inode;
+  key.offset = offset;
+
+  lock_acquire (&frame_table_lock);
+  h_elem = hash_find (&shared_frames, &key.shared_elem);
+  if (h_elem != NULL)
+    {
+      struct frame_table_entry *entry = hash_entry (h_elem, struct frame_table_entry,
+                                                    shared_elem);
+      kpage = add_sharer (entry, upage);
+      if (kpage != NULL)
+        entry->pin_cnt++;
+    }
+  lock_release (&frame_table_lock);
+
+  return kpage;
+}
+
+/* Makes KPAGE, a frame allocated by the current process and just
+   filled from the page at OFFSET in INODE's file, available for
+   sharing with other processes.  If another process published a
+   frame for the same page in the meantime, frees KPAGE and
+   returns that frame, mapped by the current process at KPAGE's
+   user address and pinned in place of KPAGE, instead.  Returns
+   KPAGE otherwise. */
+void *
+publish_shared_frame (void *kpage, struct inode *inode, off_t offset)
+{
+  struct frame_table_entry *entry;
+  struct hash_elem *h_elem;
+
+  lock_acquire (&frame_table_lock);
+  entry = find_frame (kpage);
+  ASSERT (entry != NULL && entry->inode == NULL);
+
+  entry->inode = inode;
+  entry->offset = offset;
+  h_elem = hash_insert (&shared_frames, &entry->shared_elem);
+  if (h_elem != NULL)
+    {
+      /* Lost a race with another process loading the same page. */
+      struct frame_table_entry *winner = hash_entry (h_elem, struct frame_table_entry,
+                                                     shared_elem);
+      void *shared = add_sharer (winner, entry->upage);
+      entry->inode = NULL;
+      if (shared != NULL)
+        {
+          winner->pin_cnt++;
+          internal_free_frame_with_lock_held (kpage, true);
+          kpage = shared;
+        }
+    }
+  lock_release (&frame_table_lock);
+
+  return kpage;
+}
+
+/* Drops the current process's mapping at UPAGE of frame ENTRY,
+   freeing the frame along with its last mapping.
+   FRAME_TABLE_LOCK must be held. */
+static void
+drop_mapping_with_lock_held (struct frame_table_entry *entry, void *upage)
+{
+  struct thread *t = thread_current ();
+  struct list_elem *e;
+
+  if (entry->owner == t && entry->upage == upage)
+    {
+      if (list_empty (&entry->sharers))
+        internal_free_frame_with_lock_held (entry->kpage, true);
+      else
+        {
+          /* Hand ownership to another sharer. */
+          struct frame_sharer *s = list_entry (list_pop_front (&entry->sharers),
+                                               struct frame_sharer, elem);
+          entry->owner = s->owner;
+          entry->upage = s->upage;
+          free (s);
+        }
+    }
+  else
+    for (e = list_begin (&entry->sharers); e != list_end (&entry->sharers);
+         e = list_next (e))
+      {
+        struct frame_sharer *s = list_entry (e, struct frame_sharer, elem);
+        if (s->owner == t && s->upage == upage)
+          {
+            list_remove (&s->elem);
+            free (s);
+            break;
+          }
+      }
+}
+
+/* Drops the current process's mapping at UPAGE of frame KPAGE,
+   which the caller must already have removed from its page
+   directory.  Frees the frame along with its last mapping, so
+   that a frame shared with other processes outlives this one's
+   use of it. */
+void
+release_frame (void *kpage, void *upage)
+{
+  struct frame_table_entry *entry;
+
+  lock_acquire (&frame_table_lock);
+  entry = find_frame (kpage);
+  ASSERT (entry != NULL);
+  drop_mapping_with_lock_held (entry, upage);
+  lock_release (&frame_table_lock);
+}
+
+/* Releases everything SPTE's page holds, as the current process
+   exits: its mapping in PAGEDIR, its frame and its swap slot.
+   Eviction may move the page out of its frame at any time, so
+   SPTE is only examined with FRAME_TABLE_LOCK held. */
+void
+release_page (struct supplemental_page_table_entry *spte, uint32_t *pagedir)
+{
+  lock_acquire (&frame_table_lock);
+  wait_for_eviction_with_lock_held (spte);
+  if (spte->state == ON_FRAME)
+    {
+      struct frame_table_entry *entry = find_frame (spte->kpage);
+
+      /* Keep pagedir_destroy() from freeing a frame that other
+         processes may still map. */
+      pagedir_clear_page (pagedir, spte->upage);
+      if (entry != NULL)
+        drop_mapping_with_lock_held (entry, spte->upage);
+      spte->kpage = NULL;
+    }
+  else if (spte->state == ON_ZERO_FRAME)
+    {
+      /* Keep pagedir_destroy() from freeing the zero frame. */
+      pagedir_clear_page (pagedir, spte->upage);
+    }
+  if (spte->swap_valid)
+    {
+      swap_free (spte->swap_index);
+      spte->swap_valid = false;
+    }
+  lock_release (&frame_table_lock);
+}
+
+/* Shares PARENT's page described by PARENT_SPTE, which must be on
+   a frame, with the current process, a child being forked from
+   PARENT, copy-on-write.  Both processes map the frame read-only
+   until one of them writes to it; see break_cow_frame().  Fills
+   in CHILD_SPTE and maps the page in the current process's
+   page directory.  Returns false if PARENT's page left its
+   frame in the meantime or memory is short. */
+bool
+share_cow_frame (struct thread *parent, struct supplemental_page_table_entry *parent_spte,
+                 struct supplemental_page_table_entry *child_spte)
+{
+  struct thread *t = thread_current ();
+  struct frame_table_entry *entry;
+  bool success = false;
+
+  lock_acquire (&frame_table_lock);
+  if (parent_spte->state == ON_FRAME
+      && (entry = find_frame (parent_spte->kpage)) != NULL
+      && pagedir_set_page (t->pagedir, parent_spte->upage, entry->kpage, false))
+    {
+      if (add_sharer (entry, parent_spte->upage) != NULL)
+        {
+          if (entry->inode == NULL)
+            {
+              entry->cow = true;
+              pagedir_set_writable (parent->pagedir, parent_spte->upage, false);
+            }
+          child_spte->kpage = entry->kpage;
+          child_spte->state = ON_FRAME;
+          success = true;
+        }
+      else
+        pagedir_clear_page (t->pagedir, parent_spte->upage);
+    }
+  lock_release (&frame_table_lock);
+
+  return success;
+}
+
+/* Handles a write by the current process to its page described
+   by SPTE, which is mapped read-only in PAGEDIR to a
+   copy-on-write frame.  Gives the process a frame of its own,
+   copying the shared one unless no other process maps it any
+   more, and maps it writable.  On success, the frame is left
+   pinned, as if just allocated.  Returns false if SPTE's page
+   is not on a copy-on-write frame, because it never was or
+   because it was evicted in the meantime, or if memory is
+   short. */
+bool
+break_cow_frame (struct supplemental_page_table_entry *spte, uint32_t *pagedir)
+{
+  struct frame_table_entry *entry = NULL;
+  void *kpage;
+
+  lock_acquire (&frame_table_lock);
+  kpage = spte->kpage;
+  if (spte->state == ON_FRAME)
+    entry = find_frame (kpage);
+  if (entry == NULL || !entry->cow)
+    {
+      lock_release (&frame_table_lock);
+      return false;
+    }
+  if (list_empty (&entry->sharers))
+    {
+      /* Every other process has let go of the frame. */
+      entry->cow = false;
+      entry->pin_cnt++;
+      pagedir_set_writable (pagedir, spte->upage, true);
+      lock_release (&frame_table_lock);
+      return true;
+    }
+  lock_release (&frame_table_lock);
+
+  void *copy = allocate_frame (PAL_USER, spte->upage);
+
+  lock_acquire (&frame_table_lock);
+  if (spte->state != ON_FRAME || spte->kpage != kpage)
+    {
+      /* Evicted while we were allocating. */
+      lock_release (&frame_table_lock);
+      free_frame (copy);
+      return false;
+    }
+  memcpy (copy, kpage, PGSIZE);
+  pagedir_clear_page (pagedir, spte->upage);
+  drop_mapping_with_lock_held (find_frame (kpage), spte->upage);
+  spte->kpage = copy;
+  lock_release (&frame_table_lock);
+
+  if (!pagedir_set_page (pagedir, spte->upage, copy, true))
+    {
+      unpin_frame (copy);
+      return false;
+    }
+  return true;
+}
+
 static void
 internal_free_frame (void *kpage, bool should_free_page)
 {
@@ -164,6 +1085,7 @@ free_frame_without_free_page (void *kpage)
   internal_free_frame (kpage, false);
 }
 
+/* Releases one pin on frame KPAGE, which the caller must hold. */
 void
 unpin_frame (void *kpage)
 {
@@ -171,41 +1093,82 @@ unpin_frame (void *kpage)
 
   lock_acquire (&frame_table_lock);
 
-  struct frame_table_entry entry_for_find;
-  entry_for_find.kpage = kpage;
-
-  struct hash_elem *h_elem = hash_find (&frame_table, &entry_for_find.elem);
-  if (h_elem != NULL)
-    {
-      struct frame_table_entry *entry;
-      entry = hash_entry (h_elem, struct frame_table_entry, elem);
-      entry->pinned = false;
-    }
-  else
+  struct frame_table_entry *entry = find_frame (kpage);
+  if (entry == NULL)
     PANIC ("no frame for the provided kpage");
+  ASSERT (entry->pin_cnt > 0);
+  entry->pin_cnt--;
 
   lock_release (&frame_table_lock);
 }
 
+/* Waits until frame KPAGE is not being written back by the
+   cleaner thread.  The caller must hold a pin on KPAGE, so that
+   no new write-back can start once this returns. */
 void
-pin_frame (void *kpage)
+wait_for_write_back (void *kpage)
 {
-  ASSERT (is_kernel_vaddr (kpage));
+  struct frame_table_entry *entry;
+
+  lock_acquire (&frame_table_lock);
+  entry = find_frame (kpage);
+  ASSERT (entry != NULL && entry->pin_cnt > 0);
+  while (entry->cleaning)
+    cond_wait (&write_back_done, &frame_table_lock);
+  lock_release (&frame_table_lock);
+}
+
+/* Waits until SPTE's page is not being evicted.
+   FRAME_TABLE_LOCK must be held. */
+static void
+wait_for_eviction_with_lock_held (struct supplemental_page_table_entry *spte)
+{
+  while (spte->state == EVICTING)
+    cond_wait (&write_back_done, &frame_table_lock);
+}
 
+/* Waits until SPTE's page is not being evicted, so that its
+   state says where the page is.  Must be called before the
+   owner of a page touches a page that is not mapped, since
+   eviction writes the page out only after unmapping it. */
+void
+wait_for_eviction (struct supplemental_page_table_entry *spte)
+{
   lock_acquire (&frame_table_lock);
+  wait_for_eviction_with_lock_held (spte);
+  lock_release (&frame_table_lock);
+}
 
-  struct frame_table_entry entry_for_find;
-  entry_for_find.kpage = kpage;
+/* Pins the frame that holds SPTE's page, if the page is on a
+   frame, and returns true, waiting first for any eviction of the
+   page in progress to finish.  Returns false if the page is not
+   on a frame, for example because it was evicted since it was
+   loaded. */
+bool
+pin_loaded_page (struct supplemental_page_table_entry *spte)
+{
+  struct frame_table_entry *entry;
+  bool success = false;
 
-  struct hash_elem *h_elem = hash_find (&frame_table, &entry_for_find.elem);
-  if (h_elem != NULL)
+  lock_acquire (&frame_table_lock);
+  wait_for_eviction_with_lock_held (spte);
+  if (spte->state == ON_FRAME
+      && (entry = find_frame (spte->kpage)) != NULL)
     {
-      struct frame_table_entry *entry;
-      entry = hash_entry (h_elem, struct frame_table_entry, elem);
-      entry->pinned = true;
+      entry->pin_cnt++;
+      success = true;
     }
-  else
-    PANIC ("no frame for the provided kpage");
-
   lock_release (&frame_table_lock);
+
+  return success;
+}
+
+/* Prints eviction statistics. */
+void
+frame_print_stats (void)
+{
+  printf ("Eviction: %lld on faults, %lld ahead of need, %lld frames scanned\n",
+          evict_cnt, preevict_cnt, scan_cnt);
+  printf ("Eviction: %lld dirty victims, %lld pages cleaned ahead\n",
+          dirty_evict_cnt, clean_cnt);
 }
@@ -1,20 +1,68 @@
 #include <hash.h>
+#include <list.h>
 #include "threads/thread.h"
 #include "threads/palloc.h"
+#include "filesys/off_t.h"
+
+struct inode;
 
 struct frame_table_entry
 {
   void *kpage;
   void *upage;
   struct thread *owner;
-  bool pinned;
 
-  struct hash_elem elem;
+  /* A frame is pinned, and never evicted, while PIN_CNT is
+     nonzero.  Each process that pins a frame, to load it or to
+     let the kernel access it, holds one pin and releases only
+     that one with unpin_frame(). */
+  unsigned pin_cnt;
+
+  /* A frame may be mapped by processes other than OWNER, which
+     are listed in SHARERS.  Read-only file pages are shared this
+     way between processes running the same executable; such a
+     frame is also indexed by the file's INODE and OFFSET.  Pages
+     of a forked process are shared with its parent copy-on-write,
+     marked by COW, until one of them writes to the page. */
+  struct list sharers;          /* List of struct frame_sharer. */
+  bool cow;                     /* Copy-on-write? */
+  struct inode *inode;          /* Null if not a shared file page. */
+  off_t offset;
+  struct hash_elem shared_elem;
+
+  /* Eviction clock and background write-back; see frame.c. */
+  struct list_elem ring_elem;   /* Element in the frame ring. */
+  unsigned seq;                 /* Allocation sequence number. */
+  bool clean_queued;            /* On the clean queue? */
+  bool cleaning;                /* Being written back? */
+  struct list_elem clean_elem;  /* Element in the clean queue. */
+};
+
+/* Another process's mapping of a shared frame. */
+struct frame_sharer
+{
+  struct thread *owner;
+  void *upage;
+  struct list_elem elem;
 };
 
 void frame_init (void);
 void * allocate_frame (enum palloc_flags flags, void *upage);
+void * try_allocate_frame (enum palloc_flags flags, void *upage);
+void * get_zero_frame (void);
+void * find_shared_frame (struct inode *inode, off_t offset, void *upage);
+void * publish_shared_frame (void *kpage, struct inode *inode, off_t offset);
+void release_frame (void *kpage, void *upage);
+
+struct supplemental_page_table_entry;
+void release_page (struct supplemental_page_table_entry *spte, uint32_t *pagedir);
+bool share_cow_frame (struct thread *parent, struct supplemental_page_table_entry *parent_spte,
+                      struct supplemental_page_table_entry *child_spte);
+bool break_cow_frame (struct supplemental_page_table_entry *spte, uint32_t *pagedir);
 void free_frame (void *kpage);
 void free_frame_without_free_page (void *kpage);
 void unpin_frame (void *kpage);
-void pin_frame (void *kpage);
+bool pin_loaded_page (struct supplemental_page_table_entry *spte);
+void wait_for_eviction (struct supplemental_page_table_entry *spte);
+void wait_for_write_back (void *kpage);
+void frame_print_stats (void);
@@ -25,29 +25,37 @@ spt_less_func (const struct hash_elem *a, const struct hash_elem *b, void *aux U
   return a_entry->upage < b_entry->upage;
 }
 
+/* Returns true if SPTE's page is a read-only page of an
+   executable, whose frame can be shared by every process that
+   runs the same file. */
+static bool
+is_shareable (struct supplemental_page_table_entry *spte)
+{
+  return spte->file != NULL && !spte->from_mapped_file && !spte->writable;
+}
+
 static void
 spt_destroy_func (struct hash_elem *elem, void *aux UNUSED)
 {
   struct supplemental_page_table_entry *entry = hash_entry (elem, struct supplemental_page_table_entry, elem);
 
-  if (entry->state == ON_FRAME)
-    {
-      ASSERT (entry->kpage != NULL);
-      free_frame_without_free_page (entry->kpage);
-    }
-  else if (entry->state == SWAPPED_OUT)
-    {
-      swap_free (entry->swap_index);
-    }
-
+  release_page (entry, thread_current ()->pagedir);
   free (entry);
 }
 
+/* Creates an empty supplemental page table.  Returns a null
+   pointer if memory is short. */
 struct hash *
 create_spt (void)
 {
   struct hash *spt = (struct hash *) malloc (sizeof (struct hash));
-  hash_init (spt, spt_hash_func, spt_less_func, NULL);
+  if (spt == NULL)
+    return NULL;
+  if (!hash_init (spt, spt_hash_func, spt_less_func, NULL))
+    {
+      free (spt);
+      return NULL;
+    }
   return spt;
 }
 
@@ -76,6 +84,7 @@ install_filesys_entry_in_spt (struct hash *spt, void *upage, struct file *file,
   spte->state = ON_FILESYS;
   spte->from_mapped_file = false;
   spte->dirty = false;
+  spte->swap_valid = false;
   spte->file = file;
   spte->file_offset = offset;
   spte->file_read_bytes = page_read_bytes;
@@ -104,6 +113,7 @@ install_mapped_file_entry_in_spt (struct hash *spt, void *upage, struct file *fi
   spte->state = ON_FILESYS;
   spte->from_mapped_file = true;
   spte->dirty = false;
+  spte->swap_valid = false;
   spte->file = file;
   spte->file_offset = offset;
   spte->file_read_bytes = page_read_bytes;
@@ -131,6 +141,7 @@ install_frame_entry_in_spt (struct hash *spt, void *upage, void *kpage, bool wri
   spte->state = ON_FRAME;
   spte->from_mapped_file = false;
   spte->dirty = false;
+  spte->swap_valid = false;
   spte->file = NULL;
   spte->writable = writable;
 
@@ -153,6 +164,10 @@ install_allzero_entry_in_spt (struct hash *spt, void *upage)
   spte->kpage = NULL;
   spte->state = ALL_ZERO;
   spte->dirty = false;
+  spte->swap_valid = false;
+  spte->from_mapped_file = false;
+  spte->file = NULL;
+  spte->writable = true;
 
   if(hash_insert (spt, &spte->elem) == NULL)
     return true;
@@ -187,29 +202,59 @@ has_entry_in_spt (struct hash *spt, void *upage)
   return h_elem != NULL;
 }
 
+/* Number of pages after a faulting file page to load along with
+   it, if they are free to load.  Set with -fa. */
+size_t fault_around_pages = 4;
+
+/* Loads SPTE's page from its file.  If no frame is free, evicts
+   a page to make room if EVICT is true, or fails otherwise. */
 static bool
-load_page_on_filesys (struct supplemental_page_table_entry* spte, uint32_t *pagedir)
+load_page_on_filesys (struct supplemental_page_table_entry* spte, uint32_t *pagedir, bool evict)
 {
-  /* Get a page of memory. */
-  uint8_t *kpage = allocate_frame (PAL_USER, spte->upage);
-  if (kpage == NULL)
-    return false;
-  spte->kpage = kpage;
+  bool shareable = is_shareable (spte);
+  struct inode *inode = file_get_inode (spte->file);
+
+  /* Another process running the same executable may already have
+     this page in memory. */
+  uint8_t *kpage = NULL;
+  if (shareable)
+    kpage = find_shared_frame (inode, spte->file_offset, spte->upage);
 
-  file_seek (spte->file, spte->file_offset);
-  /* Load this page. */
-  if (file_read (spte->file, spte->kpage, spte->file_read_bytes) != (int) spte->file_read_bytes)
+  if (kpage == NULL)
     {
-      free_frame (spte->kpage);
-      return false;
+      /* Get a page of memory. */
+      if (evict)
+        kpage = allocate_frame (PAL_USER, spte->upage);
+      else
+        kpage = try_allocate_frame (PAL_USER, spte->upage);
+      if (kpage == NULL)
+        return false;
+
+      /* Load this page. */
+      if (file_read_at (spte->file, kpage, spte->file_read_bytes, spte->file_offset)
+          != (int) spte->file_read_bytes)
+        {
+          free_frame (kpage);
+          return false;
+        }
+      memset (kpage + spte->file_read_bytes, 0, spte->file_zero_bytes);
+
+      if (shareable)
+        kpage = publish_shared_frame (kpage, inode, spte->file_offset);
     }
-  memset (spte->kpage + spte->file_read_bytes, 0, spte->file_zero_bytes);
+  spte->kpage = kpage;
 
   /* Add the page to the process's address space. */
   if (pagedir_get_page (pagedir, spte->upage) != NULL
       || !pagedir_set_page (pagedir, spte->upage, spte->kpage, spte->writable))
     {
-      free_frame (spte->kpage);
+      if (shareable)
+        {
+          unpin_frame (spte->kpage);
+          release_frame (spte->kpage, spte->upage);
+        }
+      else
+        free_frame (spte->kpage);
       return false;
     }
 
@@ -217,16 +262,101 @@ load_page_on_filesys (struct supplemental_page_table_entry* spte, uint32_t *page
   return true;
 }
 
+/* Fault-around: having just loaded SPTE's page from its file,
+   also loads up to FAULT_AROUND_PAGES of the pages that follow
+   it in the address space, as long as they come from the
+   following pages of the same file and frames for them are
+   free without evicting anything.  A program that runs through
+   its code or a mapped file in order then takes one fault for
+   several pages. */
+static void
+fault_around (struct hash *spt, struct supplemental_page_table_entry *spte, uint32_t *pagedir)
+{
+  size_t i;
+
+  for (i = 1; i <= fault_around_pages; i++)
+    {
+      uint8_t *upage = (uint8_t *) spte->upage + i * PGSIZE;
+      if (!is_user_vaddr (upage))
+        break;
+
+      struct supplemental_page_table_entry *next = get_entry_in_spt (spt, upage);
+      if (next == NULL || next->state != ON_FILESYS || next->file != spte->file
+          || next->file_offset != spte->file_offset + (off_t) (i * PGSIZE)
+          || !load_page_on_filesys (next, pagedir, false))
+        break;
+
+      pagedir_set_dirty (pagedir, upage, false);
+      unpin_frame (next->kpage);
+    }
+}
+
+/* Finds the pages that follow SPTE's in the address space and
+   were swapped out to the slots that follow its own, as pages
+   evicted together are, and maps them to fresh frames, as long
+   as frames are free without evicting anything.  Stores the
+   new frames in PAGES and their entries in RUN, and returns how
+   many were found, at most SWAP_BATCH_PAGES - 1.  The frames are
+   left pinned and must be filled from swap by the caller. */
+static size_t
+map_swap_neighbours (struct hash *spt, struct supplemental_page_table_entry *spte,
+                     uint32_t *pagedir, struct supplemental_page_table_entry *run[],
+                     void *pages[])
+{
+  size_t cnt;
+
+  for (cnt = 0; cnt < SWAP_BATCH_PAGES - 1; cnt++)
+    {
+      uint8_t *upage = (uint8_t *) spte->upage + (cnt + 1) * PGSIZE;
+      if (!is_user_vaddr (upage))
+        break;
+
+      struct supplemental_page_table_entry *next = get_entry_in_spt (spt, upage);
+      if (next == NULL || next->state != SWAPPED_OUT
+          || next->swap_index != spte->swap_index + cnt + 1)
+        break;
+
+      void *kpage = try_allocate_frame (PAL_USER, upage);
+      if (kpage == NULL)
+        break;
+      if (pagedir_get_page (pagedir, upage) != NULL
+          || !pagedir_set_page (pagedir, upage, kpage, next->writable))
+        {
+          free_frame (kpage);
+          break;
+        }
+
+      run[cnt] = next;
+      pages[cnt] = kpage;
+    }
+  return cnt;
+}
+
 static bool
-load_page_on_swap (struct supplemental_page_table_entry* spte, uint32_t *pagedir)
+load_page_on_swap (struct hash *spt, struct supplemental_page_table_entry* spte, uint32_t *pagedir)
 {
+  struct supplemental_page_table_entry *run[SWAP_BATCH_PAGES - 1];
+  void *pages[SWAP_BATCH_PAGES];
+  size_t cnt, i;
+
   /* Get a page of memory. */
   uint8_t *kpage = allocate_frame (PAL_USER, spte->upage);
   if (kpage == NULL)
     return false;
   spte->kpage = kpage;
 
-  swap_in (spte->swap_index, spte->kpage);
+  /* Read around: bring back the rest of the run that was swapped
+     out with this page in the same request. */
+  pages[0] = kpage;
+  cnt = map_swap_neighbours (spt, spte, pagedir, run, pages + 1);
+  swap_in (spte->swap_index, pages, cnt + 1);
+  for (i = 0; i < cnt; i++)
+    {
+      run[i]->kpage = pages[i + 1];
+      run[i]->state = ON_FRAME;
+      pagedir_set_dirty (pagedir, run[i]->upage, false);
+      unpin_frame (pages[i + 1]);
+    }
 
   /* Add the page to the process's address space. */
   if (pagedir_get_page (pagedir, spte->upage) != NULL
@@ -240,6 +370,30 @@ load_page_on_swap (struct supplemental_page_table_entry* spte, uint32_t *pagedir
   return true;
 }
 
+/* Maps SPTE's page read-only to the shared zero frame, so that a
+   page that is read before it is ever written needs no frame of
+   its own. */
+static bool
+load_page_on_zero_frame (struct supplemental_page_table_entry *spte, uint32_t *pagedir)
+{
+  if (!pagedir_set_page (pagedir, spte->upage, get_zero_frame (), false))
+    return false;
+
+  spte->kpage = NULL;
+  spte->state = ON_ZERO_FRAME;
+  return true;
+}
+
+/* Gives SPTE's page, mapped to the shared zero frame, a zeroed
+   writable frame of its own, on the first write to it. */
+static bool
+break_zero_frame (struct supplemental_page_table_entry *spte, uint32_t *pagedir)
+{
+  pagedir_clear_page (pagedir, spte->upage);
+  spte->state = ALL_ZERO;
+  return load_page_on_allzero (spte, spte->upage, pagedir);
+}
+
 bool
 load_page_on_allzero(struct supplemental_page_table_entry *spte, void *upage, uint32_t *pagedir)
 {
@@ -262,8 +416,14 @@ load_page_on_allzero(struct supplemental_page_table_entry *spte, void *upage, ui
   return true;
 }
 
+/* Makes UPAGE present in PAGEDIR, and writable too if WRITE is
+   true and the page allows it.  If PINNED is true, the page's
+   frame is left with a pin for the caller to release with
+   unpin_page(); otherwise it is left unpinned by this call.
+   Returns true if this loaded the page, false if it was already
+   present or could not be loaded. */
 bool
-load_page_from_spt (struct hash *spt, void *upage, uint32_t *pagedir, bool pinned)
+load_page_from_spt (struct hash *spt, void *upage, uint32_t *pagedir, bool write, bool pinned)
 {
   ASSERT (spt != NULL);
   ASSERT (upage != NULL);
@@ -273,19 +433,39 @@ load_page_from_spt (struct hash *spt, void *upage, uint32_t *pagedir, bool pinne
   if (spte == NULL)
     return false;
 
+  wait_for_eviction (spte);
+  enum page_state state = spte->state;
   bool result = false;
-  switch (spte->state)
+  switch (state)
     {
     case ON_FRAME:
+      if (write && spte->writable)
+        {
+          result = break_cow_frame (spte, pagedir);
+          if (!result && spte->state != ON_FRAME)
+            {
+              /* Evicted while copying: start over. */
+              return load_page_from_spt (spt, upage, pagedir, write, pinned);
+            }
+        }
       break;
     case ON_FILESYS:
-      result = load_page_on_filesys (spte, pagedir);
+      result = load_page_on_filesys (spte, pagedir, true);
+      if (result)
+        fault_around (spt, spte, pagedir);
       break;
     case SWAPPED_OUT:
-      result = load_page_on_swap (spte, pagedir);
+      result = load_page_on_swap (spt, spte, pagedir);
       break;
     case ALL_ZERO:
-      result = load_page_on_allzero(spte, upage, pagedir);
+      if (write)
+        result = load_page_on_allzero(spte, upage, pagedir);
+      else
+        result = load_page_on_zero_frame (spte, pagedir);
+      break;
+    case ON_ZERO_FRAME:
+      if (write)
+        result = break_zero_frame (spte, pagedir);
       break;
     default:
       break;
@@ -294,10 +474,18 @@ load_page_from_spt (struct hash *spt, void *upage, uint32_t *pagedir, bool pinne
   if (result)
     pagedir_set_dirty (pagedir, spte->upage, false);
 
-  if (pinned)
-    pin_frame (spte->kpage);
-  else
-    unpin_frame (spte->kpage);
+  /* Loading a page into a frame leaves it pinned.  The zero
+     frame is not in the frame table. */
+  if (result && spte->kpage != NULL)
+    {
+      if (!pinned)
+        unpin_frame (spte->kpage);
+    }
+  else if (pinned && state == ON_FRAME && !pin_loaded_page (spte))
+    {
+      /* Evicted since we looked: start over. */
+      return load_page_from_spt (spt, upage, pagedir, write, pinned);
+    }
 
   return result;
 }
@@ -311,7 +499,8 @@ unpin_page (struct hash *spt, void *upage)
   struct supplemental_page_table_entry *spte = get_entry_in_spt (spt, upage);
   if (spte == NULL)
     PANIC ("no entry for provided upage");
-  unpin_frame (spte->kpage);
+  if (spte->kpage != NULL)
+    unpin_frame (spte->kpage);
 }
 
 void
@@ -321,14 +510,23 @@ spt_unmap (struct hash *spt, void *upage, uint32_t *pagedir, off_t offset, int s
   if (spte == NULL)
     return;
 
+  wait_for_eviction (spte);
   switch (spte->state)
     {
       case ON_FRAME:
-        ASSERT (spte->kpage != NULL);
-        if (pagedir_is_dirty (pagedir, spte->upage))
-          file_write_at (spte->file, upage, size, offset);
-        free_frame (spte->kpage);
-        pagedir_clear_page (pagedir, upage);
+        /* Pin the page, so that it is not evicted while we write
+           it back, and let any earlier write-back of it by the
+           cleaner finish first, so that it cannot overwrite
+           ours.  If the page was evicted already, eviction wrote
+           it back. */
+        if (pin_loaded_page (spte))
+          {
+            wait_for_write_back (spte->kpage);
+            if (pagedir_is_dirty (pagedir, spte->upage))
+              file_write_at (spte->file, upage, size, offset);
+            pagedir_clear_page (pagedir, upage);
+            free_frame (spte->kpage);
+          }
         break;
       case ON_FILESYS:
         break;
@@ -339,3 +537,96 @@ spt_unmap (struct hash *spt, void *upage, uint32_t *pagedir, off_t offset, int s
   hash_delete (spt, &spte->elem);
 }
 
+/* Gives CHILD_SPTE, the current process's copy of PARENT's page
+   table entry PARENT_SPTE, its own copy of the page's
+   contents. */
+static bool
+fork_page (struct thread *parent, struct supplemental_page_table_entry *parent_spte,
+           struct supplemental_page_table_entry *child_spte)
+{
+  wait_for_eviction (parent_spte);
+  switch (parent_spte->state)
+    {
+    case ON_FRAME:
+      if (share_cow_frame (parent, parent_spte, child_spte))
+        return true;
+      if (parent_spte->state != ON_FRAME)
+        {
+          /* Evicted in the meantime. */
+          return fork_page (parent, parent_spte, child_spte);
+        }
+      return false;
+
+    case SWAPPED_OUT:
+      {
+        /* Swap slots are not shared, so read the page into a
+           frame of the child's own. */
+        void *kpage = allocate_frame (PAL_USER, child_spte->upage);
+        if (kpage == NULL)
+          return false;
+        swap_in (parent_spte->swap_index, &kpage, 1);
+        if (!pagedir_set_page (thread_current ()->pagedir, child_spte->upage,
+                               kpage, child_spte->writable))
+          {
+            free_frame (kpage);
+            return false;
+          }
+        child_spte->kpage = kpage;
+        child_spte->state = ON_FRAME;
+        unpin_frame (kpage);
+        return true;
+      }
+
+    case ON_ZERO_FRAME:
+      child_spte->state = ALL_ZERO;
+      return true;
+
+    default:
+      /* Not loaded yet: load on demand, like the parent.  The
+         parent's page may have been evicted since CHILD_SPTE was
+         copied from it. */
+      child_spte->state = parent_spte->state;
+      return true;
+    }
+}
+
+/* Copies the address space of PARENT, which must be blocked, into
+   the current process, a child being forked from it.  Pages on
+   frames are shared copy-on-write, pages in swap are copied
+   into frames of the child's own, and pages not loaded yet are
+   left to be loaded on demand.  The child's pages from the
+   executable refer to CHILD_EXEC, its own handle on the file.
+   Memory-mapped files are not inherited.  Returns true if
+   successful, false if memory is short. */
+bool
+fork_spt (struct thread *parent, struct file *child_exec)
+{
+  struct hash *spt = thread_current ()->spt;
+  struct hash_iterator i;
+
+  hash_first (&i, parent->spt);
+  while (hash_next (&i))
+    {
+      struct supplemental_page_table_entry *parent_spte =
+              hash_entry (hash_cur (&i), struct supplemental_page_table_entry, elem);
+      if (parent_spte->from_mapped_file)
+        continue;
+
+      struct supplemental_page_table_entry *child_spte = malloc (sizeof *child_spte);
+      if (child_spte == NULL)
+        return false;
+      *child_spte = *parent_spte;
+      child_spte->kpage = NULL;
+      child_spte->swap_valid = false;
+      if (child_spte->file != NULL)
+        child_spte->file = child_exec;
+      hash_insert (spt, &child_spte->elem);
+
+      if (!fork_page (parent, parent_spte, child_spte))
+        {
+          child_spte->state = ALL_ZERO;
+          return false;
+        }
+    }
+  return true;
+}
@@ -3,11 +3,16 @@
 
 #define MAX_STACK 0x800000
 
+/* Pages to load ahead of a fault on a file page. */
+extern size_t fault_around_pages;
+
 enum page_state {
   ON_FRAME,
   ON_FILESYS,
   SWAPPED_OUT,
   ALL_ZERO,
+  ON_ZERO_FRAME,        /* ALL_ZERO, mapped read-only to the zero frame. */
+  EVICTING,             /* Unmapped and being written out; see frame.c. */
 };
 
 struct supplemental_page_table_entry
@@ -22,6 +27,7 @@ struct supplemental_page_table_entry
   struct hash_elem elem;
 
   size_t swap_index;
+  bool swap_valid;      /* Does slot SWAP_INDEX hold a copy of the page? */
 
   struct file *file;
   off_t file_offset;
@@ -35,10 +41,12 @@ bool install_filesys_entry_in_spt (struct hash *spt, void *upage, struct file *f
 bool install_mapped_file_entry_in_spt (struct hash *spt, void *upage, struct file *file, off_t offset, uint32_t page_read_bytes, uint32_t page_zero_bytes, bool writable);
 bool has_entry_in_spt (struct hash *spt, void *upage);
 struct supplemental_page_table_entry * get_entry_in_spt (struct hash *spt, void *upage);
-bool load_page_from_spt (struct hash *spt, void *upage, uint32_t *pagedir, bool pinned);
+bool load_page_from_spt (struct hash *spt, void *upage, uint32_t *pagedir, bool write, bool pinned);
 void unpin_page (struct hash *spt, void *upage);
 bool install_frame_entry_in_spt (struct hash *spt, void *upage, void *kpage, bool writable);
 bool install_allzero_entry_in_spt (struct hash *spt, void *upage);
 bool load_page_on_allzero(struct supplemental_page_table_entry *spte, void *upage, uint32_t *pagedir);
 void spt_unmap (struct hash *spt, void *upage, uint32_t *pagedir, off_t offset, int size);
+struct thread;
+bool fork_spt (struct thread *parent, struct file *child_exec);
 
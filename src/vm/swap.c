@@ -1,12 +1,22 @@
 #include <bitmap.h>
 #include "vm/swap.h"
+#include "vm/zswap.h"
 #include "devices/block.h"
+#include "threads/thread.h"
 #include "threads/vaddr.h"
 #include "threads/synch.h"
 
+/* Swap slots are handed out in clusters of SWAP_CLUSTER_PAGES
+   contiguous slots.  Each process takes the slots for its
+   evicted pages from a cluster of its own, so pages evicted
+   from one process end up next to each other on disk, where
+   they can be written and read back in long requests. */
+#define SWAP_CLUSTER_PAGES 32
+
 static struct block *swap_device;
 static struct bitmap *swap_table;
 static struct lock swap_lock;
+static size_t swap_cursor;      /* Where to look for a new cluster. */
 
 static const size_t block_sectors_per_page = PGSIZE / BLOCK_SECTOR_SIZE;
 
@@ -17,6 +27,8 @@ swap_init (void)
   swap_device = block_get_role (BLOCK_SWAP);
   swap_table = bitmap_create (block_size (swap_device) / block_sectors_per_page);
   bitmap_set_all (swap_table, false);
+  swap_cursor = 0;
+  zswap_init (bitmap_size (swap_table));
 }
 
 void
@@ -25,46 +37,158 @@ swap_destroy (void)
   bitmap_destroy (swap_table);
 }
 
-void
-swap_in (size_t index, void *addr)
+/* Transfers CNT pages between PAGES and the CNT consecutive
+   swap slots starting at INDEX on the swap device, in a single
+   request. */
+static void
+device_transfer (size_t index, void *pages[], size_t cnt, bool write)
 {
-  ASSERT (is_kernel_vaddr (addr));
-  lock_acquire (&swap_lock);
+  struct bio_vec vec[SWAP_BATCH_PAGES];
+  struct bio bio;
+  size_t i;
 
-  if (bitmap_test (swap_table, index) == false)
-    PANIC ("empty slot");
+  ASSERT (cnt > 0 && cnt <= SWAP_BATCH_PAGES);
+  for (i = 0; i < cnt; i++)
+    {
+      ASSERT (is_kernel_vaddr (pages[i]));
+      vec[i].buffer = pages[i];
+      vec[i].cnt = block_sectors_per_page;
+    }
+
+  bio.sector = index * block_sectors_per_page;
+  bio.write = write;
+  bio.vec = vec;
+  bio.vec_cnt = cnt;
+  bio.end = NULL;
+  block_submit (swap_device, &bio);
+  bio_wait (&bio);
+}
+
+/* Transfers CNT pages between PAGES and the CNT consecutive
+   swap slots starting at INDEX.  Pages that compressed swap
+   holds, or can take, are handled there.  The rest go to or
+   from the swap device, one request per run of consecutive
+   slots. */
+static void
+swap_transfer (size_t index, void *pages[], size_t cnt, bool write)
+{
+  size_t run = 0;               /* Pages just before I left for disk. */
   size_t i;
-  for (i = 0; i < block_sectors_per_page; i++)
+
+  for (i = 0; i < cnt; i++)
     {
-      block_read (swap_device, index * block_sectors_per_page + i, addr + BLOCK_SECTOR_SIZE * i);
+      bool in_pool = (write
+                      ? zswap_store (index + i, pages[i])
+                      : zswap_load (index + i, pages[i]));
+      if (!in_pool)
+        run++;
+      else if (run > 0)
+        {
+          device_transfer (index + i - run, pages + i - run, run, write);
+          run = 0;
+        }
     }
-  bitmap_set (swap_table, index, false);
-  lock_release (&swap_lock);
+  if (run > 0)
+    device_transfer (index + cnt - run, pages + cnt - run, run, write);
 }
 
-size_t
-swap_out (void *addr)
+/* Reads the CNT pages stored in the swap slots starting at
+   INDEX into PAGES.  The slots stay allocated, so that a page
+   that is not modified afterward can be evicted again without
+   being rewritten; free them with swap_free() when the copy is
+   no longer wanted. */
+void
+swap_in (size_t index, void *pages[], size_t cnt)
 {
-  ASSERT (is_kernel_vaddr (addr));
   lock_acquire (&swap_lock);
+  if (!bitmap_all (swap_table, index, cnt))
+    PANIC ("empty slot");
+  lock_release (&swap_lock);
 
-  size_t index = bitmap_scan (swap_table, 0, 1, false);
-  size_t i;
-  for (i = 0; i < block_sectors_per_page; i++)
+  swap_transfer (index, pages, cnt, false);
+}
+
+/* Allocates CNT consecutive swap slots for pages of OWNER,
+   preferably from OWNER's current cluster, and returns the
+   first.  Returns BITMAP_ERROR if swap has no CNT consecutive
+   free slots.  SWAP_LOCK must be held. */
+static size_t
+alloc_slots (struct thread *owner, size_t cnt)
+{
+  size_t index;
+
+  ASSERT (lock_held_by_current_thread (&swap_lock));
+
+  if (owner->swap_next + cnt <= owner->swap_end
+      && bitmap_none (swap_table, owner->swap_next, cnt))
+    index = owner->swap_next;
+  else
     {
-      block_write (swap_device, index * block_sectors_per_page + i, addr + BLOCK_SECTOR_SIZE * i);
+      /* Start a new cluster, searching onward from the last one
+         handed out so that clusters fill the disk in order. */
+      index = bitmap_scan (swap_table, swap_cursor, SWAP_CLUSTER_PAGES, false);
+      if (index == BITMAP_ERROR)
+        index = bitmap_scan (swap_table, 0, SWAP_CLUSTER_PAGES, false);
+      if (index != BITMAP_ERROR)
+        {
+          owner->swap_end = index + SWAP_CLUSTER_PAGES;
+          swap_cursor = owner->swap_end;
+        }
+      else
+        {
+          /* Swap is too fragmented for a whole cluster. */
+          index = bitmap_scan (swap_table, 0, cnt, false);
+          if (index == BITMAP_ERROR)
+            return BITMAP_ERROR;
+          owner->swap_end = index + cnt;
+        }
     }
-  bitmap_set (swap_table, index, true);
-  lock_release (&swap_lock);
+
+  bitmap_set_multiple (swap_table, index, cnt, true);
+  owner->swap_next = index + cnt;
   return index;
 }
 
+/* Writes the CNT pages in PAGES, which belong to OWNER, to
+   swap and stores the slot used for each in the corresponding
+   element of SLOTS.  The pages are written to consecutive slots
+   in a single request if swap has room for them together, or
+   one at a time otherwise. */
+void
+swap_out (struct thread *owner, void *pages[], size_t cnt, size_t slots[])
+{
+  size_t index;
+  size_t i;
+
+  lock_acquire (&swap_lock);
+  index = alloc_slots (owner, cnt);
+  if (index != BITMAP_ERROR)
+    for (i = 0; i < cnt; i++)
+      slots[i] = index + i;
+  else
+    for (i = 0; i < cnt; i++)
+      {
+        slots[i] = alloc_slots (owner, 1);
+        if (slots[i] == BITMAP_ERROR)
+          PANIC ("swap is full");
+      }
+  lock_release (&swap_lock);
+
+  if (index != BITMAP_ERROR)
+    swap_transfer (index, pages, cnt, true);
+  else
+    for (i = 0; i < cnt; i++)
+      swap_transfer (slots[i], &pages[i], 1, true);
+}
+
 void
 swap_free (size_t index)
 {
   lock_acquire (&swap_lock);
   if (bitmap_test (swap_table, index) == false)
     PANIC ("empty slot");
+  /* Drop any compressed copy before the slot can be reused. */
+  zswap_invalidate (index);
   bitmap_set (swap_table, index, false);
   lock_release (&swap_lock);
 }
@@ -1,7 +1,12 @@
 #include <stddef.h>
 
+struct thread;
+
+/* Most pages moved to or from swap in a single request. */
+#define SWAP_BATCH_PAGES 8
+
 void swap_init (void);
 void swap_destroy (void);
-void swap_in (size_t index, void *addr);
-size_t swap_out (void *addr);
+void swap_in (size_t index, void *pages[], size_t cnt);
+void swap_out (struct thread *owner, void *pages[], size_t cnt, size_t slots[]);
 void swap_free (size_t index);
@@ -0,0 +1,379 @@
+#include "vm/zswap.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Compressed swap.
+
+   Pages on their way to swap are first compressed and, if they
+   shrink enough, kept in a pool of kernel pages instead of
+   being written to the swap device.  A later swap-in of the
+   same slot then costs a decompression rather than a disk
+   read.  Only when the pool has no room left, or a page does
+   not compress, does the page go to disk.
+
+   The pool is a single contiguous run of pages divided into
+   chunks of ZSWAP_CHUNK bytes.  A compressed page occupies a
+   run of consecutive chunks, found with a bitmap. */
+
+/* Allocation unit within the pool, in bytes. */
+#define ZSWAP_CHUNK 64
+
+/* Pages that compress to more than this many bytes are not
+   worth keeping in the pool. */
+#define ZSWAP_MAX_SIZE (PGSIZE * 3 / 4)
+
+size_t zswap_pool_pages = 32;
+
+/* A swap slot's compressed copy, if it has one. */
+struct zswap_slot
+  {
+    uint32_t chunk;             /* First chunk in the pool. */
+    uint16_t size;              /* Compressed size, 0 if none. */
+  };
+
+static struct lock zswap_lock;
+static uint8_t *pool;                   /* ZSWAP_POOL_PAGES pages. */
+static struct bitmap *pool_chunks;      /* Chunks in use. */
+static struct zswap_slot *slots;        /* One per swap slot. */
+static size_t slot_cnt;
+
+/* Statistics. */
+static long long store_cnt;             /* Pages kept in the pool. */
+static long long reject_cnt;            /* Pages that did not compress. */
+static long long full_cnt;              /* Pages the pool had no room for. */
+static long long load_cnt;              /* Swap-ins. */
+static long long hit_cnt;               /* Swap-ins served by the pool. */
+static long long stored_bytes;          /* Compressed bytes in the pool. */
+static long long compressed_bytes;      /* Total size of pages stored. */
+
+static size_t lz_compress (const uint8_t *src, uint8_t *dst, size_t dst_max);
+static void lz_decompress (const uint8_t *src, uint8_t *dst);
+
+/* Initializes compressed swap for a swap device with SLOT_CNT
+   page-sized slots.  Leaves it disabled if the pool cannot be
+   allocated. */
+void
+zswap_init (size_t slot_cnt_)
+{
+  lock_init (&zswap_lock);
+  slot_cnt = slot_cnt_;
+  if (zswap_pool_pages == 0)
+    return;
+
+  pool = palloc_get_multiple (0, zswap_pool_pages);
+  pool_chunks = bitmap_create (zswap_pool_pages * PGSIZE / ZSWAP_CHUNK);
+  slots = calloc (slot_cnt, sizeof *slots);
+  if (pool == NULL || pool_chunks == NULL || slots == NULL)
+    {
+      printf ("zswap: cannot allocate %zu-page pool, disabled\n",
+              zswap_pool_pages);
+      if (pool != NULL)
+        palloc_free_multiple (pool, zswap_pool_pages);
+      if (pool_chunks != NULL)
+        bitmap_destroy (pool_chunks);
+      free (slots);
+      pool = NULL;
+    }
+}
+
+/* Frees SLOT's compressed copy, if any.  ZSWAP_LOCK must be
+   held. */
+static void
+release_slot (size_t slot)
+{
+  struct zswap_slot *s = &slots[slot];
+
+  if (s->size != 0)
+    {
+      bitmap_set_multiple (pool_chunks, s->chunk,
+                           DIV_ROUND_UP (s->size, ZSWAP_CHUNK), false);
+      stored_bytes -= s->size;
+      s->size = 0;
+    }
+}
+
+/* Tries to keep a compressed copy of PAGE as the contents of
+   swap slot SLOT.  Returns true if successful, false if PAGE
+   must be written to the swap device instead. */
+bool
+zswap_store (size_t slot, const void *page)
+{
+  static uint8_t buffer[ZSWAP_MAX_SIZE];
+  bool success = false;
+
+  if (pool == NULL)
+    return false;
+  ASSERT (slot < slot_cnt);
+
+  lock_acquire (&zswap_lock);
+  release_slot (slot);
+
+  size_t size = lz_compress (page, buffer, sizeof buffer);
+  if (size == 0)
+    reject_cnt++;
+  else
+    {
+      size_t chunk = bitmap_scan_and_flip (pool_chunks, 0,
+                                           DIV_ROUND_UP (size, ZSWAP_CHUNK),
+                                           false);
+      if (chunk == BITMAP_ERROR)
+        full_cnt++;
+      else
+        {
+          memcpy (pool + chunk * ZSWAP_CHUNK, buffer, size);
+          slots[slot].chunk = chunk;
+          slots[slot].size = size;
+          stored_bytes += size;
+          compressed_bytes += size;
+          store_cnt++;
+          success = true;
+        }
+    }
+  lock_release (&zswap_lock);
+
+  return success;
+}
+
+/* If swap slot SLOT's contents are in the pool, decompresses
+   them into PAGE and returns true.  Otherwise returns false,
+   and the caller must read the slot from the swap device.
+   The pool keeps its copy until zswap_invalidate(). */
+bool
+zswap_load (size_t slot, void *page)
+{
+  bool hit = false;
+
+  if (pool == NULL)
+    return false;
+  ASSERT (slot < slot_cnt);
+
+  lock_acquire (&zswap_lock);
+  load_cnt++;
+  if (slots[slot].size != 0)
+    {
+      lz_decompress (pool + slots[slot].chunk * ZSWAP_CHUNK, page);
+      hit_cnt++;
+      hit = true;
+    }
+  lock_release (&zswap_lock);
+
+  return hit;
+}
+
+/* Discards swap slot SLOT's compressed copy, if it has one. */
+void
+zswap_invalidate (size_t slot)
+{
+  if (pool == NULL)
+    return;
+  ASSERT (slot < slot_cnt);
+
+  lock_acquire (&zswap_lock);
+  release_slot (slot);
+  lock_release (&zswap_lock);
+}
+
+/* Prints compressed swap statistics. */
+void
+zswap_print_stats (void)
+{
+  if (pool == NULL)
+    return;
+
+  printf ("Zswap: %lld pages stored, %lld incompressible, %lld pool full\n",
+          store_cnt, reject_cnt, full_cnt);
+  printf ("Zswap: %lld of %lld swap-ins hit, %lld bytes in %zu-page pool\n",
+          hit_cnt, load_cnt, stored_bytes, zswap_pool_pages);
+  if (compressed_bytes > 0)
+    printf ("Zswap: compression ratio %lld.%02lld:1\n",
+            store_cnt * PGSIZE / compressed_bytes,
+            store_cnt * PGSIZE * 100 / compressed_bytes % 100);
+}
+
+/* Compression.
+
+   A simple LZ77 compressor in the style of LZ4, tuned for
+   speed rather than ratio.  The compressed form of a page is a
+   series of sequences, each a run of literal bytes followed by
+   a copy of earlier output:
+
+     - A token byte.  Its high 4 bits are the number of
+       literals, its low 4 bits the length of the copy minus
+       LZ_MIN_MATCH.  A value of 15 in either field is extended
+       by the bytes that follow (see lz_put_length()).
+
+     - The literals.
+
+     - The distance back to the start of the copy, 2 bytes,
+       little-endian.
+
+   The last sequence has only literals; it ends the page. */
+
+/* Shortest copy worth encoding. */
+#define LZ_MIN_MATCH 4
+
+/* Hash table of recent positions, indexed by a hash of the 4
+   bytes found there.  Protected by ZSWAP_LOCK. */
+#define LZ_HASH_BITS 10
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+/* Returns the 4 bytes at P as an integer. */
+static inline uint32_t
+lz_read32 (const uint8_t *p)
+{
+  uint32_t x;
+  memcpy (&x, p, sizeof x);
+  return x;
+}
+
+/* Hashes 4 bytes X into an LZ_TABLE index. */
+static inline unsigned
+lz_hash (uint32_t x)
+{
+  return (x * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the extension of a length field whose value, less the
+   15 already encoded in the token, is LEN: a byte of 255 for
+   each full 255, then the remainder. */
+static uint8_t *
+lz_put_length (uint8_t *op, size_t len)
+{
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/* Reads a length field extension written by lz_put_length()
+   from *IP and returns it. */
+static size_t
+lz_get_length (const uint8_t **ip)
+{
+  size_t len = 0;
+  uint8_t b;
+
+  do
+    {
+      b = *(*ip)++;
+      len += b;
+    }
+  while (b == 255);
+  return len;
+}
+
+/* Appends to OP a sequence of LIT_CNT literals from LIT,
+   followed by a copy of MATCH_LEN bytes from DISTANCE back, or
+   by nothing if MATCH_LEN is 0.  Returns the new end of output,
+   or a null pointer if the sequence would overrun END. */
+static uint8_t *
+lz_put_sequence (uint8_t *op, uint8_t *end, const uint8_t *lit,
+                 size_t lit_cnt, size_t distance, size_t match_len)
+{
+  size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+
+  if ((size_t) (end - op) < 1 + lit_cnt / 255 + 1 + lit_cnt + 2
+                            + match_code / 255 + 1)
+    return NULL;
+
+  *op++ = ((lit_cnt < 15 ? lit_cnt : 15) << 4
+           | (match_code < 15 ? match_code : 15));
+  if (lit_cnt >= 15)
+    op = lz_put_length (op, lit_cnt - 15);
+  memcpy (op, lit, lit_cnt);
+  op += lit_cnt;
+
+  if (match_len > 0)
+    {
+      *op++ = distance & 0xff;
+      *op++ = distance >> 8;
+      if (match_code >= 15)
+        op = lz_put_length (op, match_code - 15);
+    }
+  return op;
+}
+
+/* Compresses the page at SRC into DST, which has room for
+   DST_MAX bytes.  Returns the compressed size, or 0 if it would
+   not fit.  ZSWAP_LOCK must be held. */
+static size_t
+lz_compress (const uint8_t *src, uint8_t *dst, size_t dst_max)
+{
+  uint8_t *op = dst;
+  uint8_t *end = dst + dst_max;
+  size_t anchor = 0;
+  size_t ip = 0;
+
+  ASSERT (lock_held_by_current_thread (&zswap_lock));
+
+  memset (lz_table, 0, sizeof lz_table);
+  while (ip + LZ_MIN_MATCH <= PGSIZE)
+    {
+      uint32_t x = lz_read32 (src + ip);
+      unsigned h = lz_hash (x);
+      size_t ref = lz_table[h];
+
+      lz_table[h] = ip;
+      if (ref < ip && lz_read32 (src + ref) == x)
+        {
+          size_t len = LZ_MIN_MATCH;
+          while (ip + len < PGSIZE && src[ref + len] == src[ip + len])
+            len++;
+
+          op = lz_put_sequence (op, end, src + anchor, ip - anchor,
+                                ip - ref, len);
+          if (op == NULL)
+            return 0;
+          ip += len;
+          anchor = ip;
+        }
+      else
+        ip++;
+    }
+
+  op = lz_put_sequence (op, end, src + anchor, PGSIZE - anchor, 0, 0);
+  return op != NULL ? op - dst : 0;
+}
+
+/* Decompresses the page compressed at SRC into DST. */
+static void
+lz_decompress (const uint8_t *src, uint8_t *dst)
+{
+  const uint8_t *ip = src;
+  size_t op = 0;
+
+  for (;;)
+    {
+      uint8_t token = *ip++;
+      size_t lit_cnt = token >> 4;
+      size_t match_len = token & 15;
+
+      if (lit_cnt == 15)
+        lit_cnt += lz_get_length (&ip);
+      ASSERT (op + lit_cnt <= PGSIZE);
+      memcpy (dst + op, ip, lit_cnt);
+      ip += lit_cnt;
+      op += lit_cnt;
+      if (op == PGSIZE)
+        break;
+
+      size_t distance = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (match_len == 15)
+        match_len += lz_get_length (&ip);
+      match_len += LZ_MIN_MATCH;
+      ASSERT (distance > 0 && distance <= op && op + match_len <= PGSIZE);
+
+      /* Byte by byte, since the copy may overlap itself. */
+      for (; match_len > 0; match_len--, op++)
+        dst[op] = dst[op - distance];
+    }
+}
@@ -0,0 +1,11 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Number of kernel pages in the compressed swap pool. */
+extern size_t zswap_pool_pages;
+
+void zswap_init (size_t slot_cnt);
+bool zswap_store (size_t slot, const void *page);
+bool zswap_load (size_t slot, void *page);
+void zswap_invalidate (size_t slot);
+void zswap_print_stats (void);